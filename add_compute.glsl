@@ -23,8 +23,14 @@ layout(location = 5) uniform float dt;
 layout(location = 6) uniform float diff;
 
 
+// Grid size, injected by load_compute_shader. W x H interior cells, N is the
+// grid scale (1 / cell size).
+#ifndef W
+#define W 200
+#define H 200
 #define N 200
-#define IX(i,j) ((i)+(N+2)*(j))
+#endif
+#define IX(i,j) ((i)+(W+2)*(j))
 
 float add_source(vec4 value, ivec2 texel_coord, float dt) {
   int arr_coord = IX(texel_coord.x, texel_coord.y);
@@ -22,11 +22,22 @@ layout(std430, binding = 4) buffer vvel_layout {
 layout(location = 5) uniform float dt;
 layout(location = 6) uniform float diff;
 
-layout(rgba8, binding = 7) uniform image2D border_input;
+// ObstacleMap flags of every cell, uploaded once by main.cpp: bit 0 is set
+// for fluid cells, bits 1-4 when the left, right, lower and upper neighbour
+// is open.
+layout(std430, binding = 8) buffer flags_layout {
+  uint cell_flags[];
+};
 
 
+// Grid size, injected by load_compute_shader. W x H interior cells, N is the
+// grid scale (1 / cell size).
+#ifndef W
+#define W 200
+#define H 200
 #define N 200
-#define IX(i,j) ((i)+(N+2)*(j))
+#endif
+#define IX(i,j) ((i)+(W+2)*(j))
 
 float advect(vec4 value, ivec2 texel_coord, float diff, float dt) {
 
@@ -38,18 +49,19 @@ float advect(vec4 value, ivec2 texel_coord, float diff, float dt) {
   float x = texel_coord.x - dt0 * vel_u[arr_coord];
   float y = texel_coord.y - dt0 * vel_v[arr_coord];
   if (x < 0.5) x = 0.5;
-  if (x > N + 0.5) x = N + 0.5;
+  if (x > W + 0.5) x = W + 0.5;
   i0 = int(x);
   i1 = i0 + 1;
   if (y < 0.5) y = 0.5;
-  if (y > N + 0.5) y = N + 0.5;
+  if (y > H + 0.5) y = H + 0.5;
   j0 = int(y);
   j1 = j0 + 1;
   s1 = x - i0;
   s0 = 1 - s1;
   t1 = y - j0;
   t0 = 1 - t1;
-  dest_density[arr_coord] = s0 * (t0 * src_density[IX(i0, j0)] + t1 * src_density[IX(i0, j1)]) + s1 * (t0 * src_density[IX(i1, j0)] + t1 * src_density[IX(i1, j1)]);
+  float fluid = float(cell_flags[arr_coord] & 1u);
+  dest_density[arr_coord] = fluid * (s0 * (t0 * src_density[IX(i0, j0)] + t1 * src_density[IX(i0, j1)]) + s1 * (t0 * src_density[IX(i1, j0)] + t1 * src_density[IX(i1, j1)]));
   return dest_density[arr_coord];
 }
 
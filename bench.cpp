@@ -0,0 +1,252 @@
+#include "redblack.h"
+#include "solver.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Times each solver stage on its own across a range of grid sizes.
+//
+//   FluidBench [--sizes 128,200,512,1024,2048] [--reps R] [--threads T]
+//              [--json] [--out FILE]
+//
+// For every stage the median of R repetitions is reported as ns per interior
+// cell per step, together with the memory bandwidth that implies. Bandwidth
+// is counted from the streams each kernel reads and writes once per cell
+// (stencil neighbours and bilinear gathers are assumed to hit cache), so it
+// is a lower bound on the real traffic. project_b_multigrid solves to the
+// solver's default tolerance, so its traffic depends on the iteration count
+// and is reported as zero. step runs the fused passes at every size,
+// whatever Solver::fused_min_cells says, and step_unfused one pass per
+// stage; both are counted with the streams they actually make. The
+// advect_maccormack and advect_bfecc stages count all of their passes.
+//
+// Before timing, the red-black row kernel of every SIMD level up to the one
+// in use relaxes the same field, and FluidBench stops with an error unless
+// they all agree bit for bit with the scalar kernel.
+
+struct Stage {
+  const char* name;
+  // Bytes streamed per interior cell for one call of the stage.
+  double bytes_per_cell;
+  std::function<void()> run;
+};
+
+struct Result {
+  int n;
+  const char* stage;
+  double ns_per_cell;
+  double gb_per_second;
+};
+
+static void print_usage() {
+  std::cerr << "usage: FluidBench [--sizes 128,200,512,1024,2048] [--reps R] [--threads T] [--json] [--out FILE]" << std::endl;
+}
+
+static std::vector<int> parse_sizes(const char* text) {
+  std::vector<int> sizes;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    int n = std::atoi(item.c_str());
+    if (n > 0) sizes.push_back(n);
+  }
+  return sizes;
+}
+
+// Deterministic swirl plus a blob of dye, so advect gathers from realistic
+// distances instead of reading straight down a zero velocity field.
+static void fill_fields(Solver& s) {
+  int n = s.width();
+  unsigned int seed = 12345;
+  for (int j = 1; j <= n; j++) {
+    for (int i = 1; i <= n; i++) {
+      float x = (i - 0.5f) / n - 0.5f;
+      float y = (j - 0.5f) / n - 0.5f;
+      seed = seed * 1664525u + 1013904223u;
+      float noise = (seed >> 8) / 16777216.0f - 0.5f;
+      s.velocity_u()[s.index(i, j)] = -y + 0.05f * noise;
+      s.velocity_v()[s.index(i, j)] = x - 0.05f * noise;
+      s.density()[s.index(i, j)] = (x * x + y * y < 0.04f) ? 1.0f : 0.0f;
+    }
+  }
+}
+
+// 20 red-black sweeps of a noisy field with each SIMD level. The width is
+// not a multiple of 16, so the masked tails are covered too.
+static bool check_simd_levels() {
+  const int w = 203, h = 61, stride = w + 2;
+  const float a = 0.7f, c = 1.0f / (1 + 4 * a);
+  std::vector<float> x0((size_t)stride * (h + 2), 0.0f), b(x0.size(), 0.0f);
+  unsigned int seed = 12345;
+  for (int j = 1; j <= h; j++) {
+    for (int i = 1; i <= w; i++) {
+      seed = seed * 1664525u + 1013904223u;
+      x0[i + stride * j] = (seed >> 8) / 16777216.0f;
+      seed = seed * 1664525u + 1013904223u;
+      b[i + stride * j] = (seed >> 8) / 16777216.0f - 0.5f;
+    }
+  }
+
+  ThreadPool pool(1);
+  std::vector<float> reference;
+  for (int level = SimdScalar; level <= simd_level(); level++) {
+    std::vector<float> x = x0;
+    for (int k = 0; k < 20; k++) {
+      redblack_sweep(pool, redblack_row((SimdLevel)level), w, h, x.data(), b.data(), a, c);
+    }
+    if (level == SimdScalar) {
+      reference = x;
+    } else if (std::memcmp(x.data(), reference.data(), x.size() * sizeof(float)) != 0) {
+      std::cerr << "simd check: " << simd_level_name((SimdLevel)level) << " differs from scalar" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+
+  std::vector<int> sizes = { 128, 200, 512, 1024, 2048 };
+  int reps = 5;
+  int threads = 0;
+  bool json = false;
+  const char* out_path = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--json") == 0) {
+      json = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      print_usage();
+      return 1;
+    }
+    if (std::strcmp(argv[i], "--sizes") == 0) sizes = parse_sizes(argv[++i]);
+    else if (std::strcmp(argv[i], "--reps") == 0) reps = std::max(1, std::atoi(argv[++i]));
+    else if (std::strcmp(argv[i], "--threads") == 0) threads = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--out") == 0) out_path = argv[++i];
+    else {
+      print_usage();
+      return 1;
+    }
+  }
+
+  if (!check_simd_levels()) return 1;
+
+  const float dt = 1.0f / 60.0f;
+  std::vector<Result> results;
+  int thread_count = 1;
+
+  for (int n : sizes) {
+    Solver s(n, n, threads);
+    thread_count = s.thread_count();
+    s.fused_min_cells = 0;
+    fill_fields(s);
+
+    float* u = s.velocity_u();
+    float* v = s.velocity_v();
+    float* up = s.velocity_u_source();
+    float* vp = s.velocity_v_source();
+    float* d = s.density();
+    float* dp = s.density_source();
+    int iterations = s.iterations;
+    int passes = (iterations + s.sweeps_per_pass - 1) / s.sweeps_per_pass;
+
+    std::vector<Stage> stages = {
+      { "add_source", 12, [&] { s.add_source(up, u, dt); } },
+      { "diffuse", 12.0 * iterations, [&] { s.diffuse(dp, d, s.diff, dt); } },
+      { "diffuse_jacobi", 12.0 * iterations, [&] {
+        s.relaxation = Solver::Jacobi;
+        s.diffuse(dp, d, s.diff, dt);
+        s.relaxation = Solver::RedBlack;
+      } },
+      { "project_a", 16, [&] { s.divergence(u, v, up, vp); } },
+      { "project_b", 12.0 * iterations, [&] { s.pressure_solve(up, vp); } },
+      { "project_b_jacobi", 12.0 * iterations, [&] {
+        s.relaxation = Solver::Jacobi;
+        s.pressure_solve(up, vp);
+        s.relaxation = Solver::RedBlack;
+      } },
+      { "project_b_multigrid", 0, [&] {
+        s.pressure_method = Solver::Multigrid;
+        std::fill(up, up + s.array_size(), 0.0f);
+        s.pressure_solve(up, vp);
+        s.pressure_method = Solver::Sweeps;
+      } },
+      { "project_c", 20, [&] { s.subtract_gradient(u, v, up); } },
+      { "advect", 16, [&] { s.advect(dp, d, u, v, dt); } },
+      { "advect_maccormack", 36, [&] {
+        s.advection = Solver::MacCormack;
+        s.advect(dp, d, u, v, dt);
+        s.advection = Solver::SemiLagrangian;
+      } },
+      { "advect_bfecc", 56, [&] {
+        s.advection = Solver::Bfecc;
+        s.advect(dp, d, u, v, dt);
+        s.advection = Solver::SemiLagrangian;
+      } },
+      { "step", 100.0 + 60.0 * passes, [&] { s.clear_sources(); s.step(dt); } },
+      { "step_unfused", 156.0 + 60.0 * iterations, [&] {
+        s.fused = false;
+        s.clear_sources();
+        s.step(dt);
+        s.fused = true;
+      } },
+    };
+
+    double cells = (double)n * n;
+
+    for (Stage& stage : stages) {
+      stage.run();
+
+      std::vector<double> times;
+      for (int r = 0; r < reps; r++) {
+        auto start = std::chrono::steady_clock::now();
+        stage.run();
+        auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+      }
+      std::sort(times.begin(), times.end());
+      double ns = times[times.size() / 2];
+
+      Result result = { n, stage.name, ns / cells, stage.bytes_per_cell * cells / ns };
+      results.push_back(result);
+      std::cerr << n << " " << stage.name << " " << result.ns_per_cell << " ns/cell" << std::endl;
+    }
+  }
+
+  std::ofstream file;
+  if (out_path) {
+    file.open(out_path);
+    if (!file) {
+      std::cerr << "could not open " << out_path << std::endl;
+      return 1;
+    }
+  }
+  std::ostream& out = out_path ? file : std::cout;
+
+  if (json) {
+    out << "{\n  \"simd\": \"" << simd_level_name(simd_level()) << "\",\n  \"threads\": " << thread_count << ",\n  \"reps\": " << reps << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+      const Result& r = results[i];
+      out << "    { \"n\": " << r.n << ", \"stage\": \"" << r.stage << "\", \"ns_per_cell\": " << r.ns_per_cell;
+      out << ", \"gb_per_second\": " << r.gb_per_second << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+  } else {
+    out << "n,stage,ns_per_cell,gb_per_second,threads,simd\n";
+    for (const Result& r : results) {
+      out << r.n << "," << r.stage << "," << r.ns_per_cell << "," << r.gb_per_second << "," << thread_count << "," << simd_level_name(simd_level()) << "\n";
+    }
+  }
+
+  return 0;
+}
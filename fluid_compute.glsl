@@ -22,24 +22,26 @@ layout(std430, binding = 4) buffer array_four {
 layout(location = 5) uniform float dt;
 layout(location = 6) uniform float diff;
 
-layout(rgba8, binding = 7) uniform image2D border_input;
-
-//void set_boundaries(ivec2 texel_coord) {
-//
-//
-//
-//  int arr_coord = IX(texel_coord.x, texel_coord.y);
-//  int arr_coord_yu = IX(texel_coord.x, texel_coord.y + 1);
-//  int arr_coord_yd = IX(texel_coord.x, texel_coord.y - 1);
-//  int arr_coord_xr = IX(texel_coord.x + 1, texel_coord.y);
-//  int arr_coord_xl = IX(texel_coord.x - 1, texel_coord.y);
-//
-//  if (imageLoad(border_input, arr_coord_yu, value).a > 0)
-//}
+// 0 for density, which reflects off walls, 1 and 2 for the velocity
+// components, which are held at zero in solids.
+layout(location = 7) uniform int boundary;
+
+// ObstacleMap flags of every cell, uploaded once by main.cpp: bit 0 is set
+// for fluid cells, bits 1-4 when the left, right, lower and upper neighbour
+// is open.
+layout(std430, binding = 8) buffer flags_layout {
+  uint cell_flags[];
+};
 
 
+// Grid size, injected by load_compute_shader. W x H interior cells, N is the
+// grid scale (1 / cell size).
+#ifndef W
+#define W 200
+#define H 200
 #define N 200
-#define IX(i,j) ((i)+(N+2)*(j))
+#endif
+#define IX(i,j) ((i)+(W+2)*(j))
 
 float diffuse(vec4 value, ivec2 texel_coord, float diff, float dt) {
 
@@ -51,7 +53,16 @@ float diffuse(vec4 value, ivec2 texel_coord, float diff, float dt) {
   int arr_coord_xr = IX(texel_coord.x + 1, texel_coord.y);
   int arr_coord_xl = IX(texel_coord.x - 1, texel_coord.y);
 
-  dest_density[arr_coord] = (src_density[arr_coord] + a * (dest_density[arr_coord_yu] + dest_density[arr_coord_yd] + dest_density[arr_coord_xr] + dest_density[arr_coord_xl])) / (1 + 4 * a);
+  // Velocity is zero in solids, so it can sum every neighbour; density only
+  // sums the open ones and relaxes towards their average.
+  uint flags = cell_flags[arr_coord] | (boundary == 0 ? 0u : 30u);
+  float fluid = float(flags & 1u);
+  float xl = float((flags >> 1) & 1u);
+  float xr = float((flags >> 2) & 1u);
+  float yd = float((flags >> 3) & 1u);
+  float yu = float((flags >> 4) & 1u);
+
+  dest_density[arr_coord] = fluid * (src_density[arr_coord] + a * (yu * dest_density[arr_coord_yu] + yd * dest_density[arr_coord_yd] + xr * dest_density[arr_coord_xr] + xl * dest_density[arr_coord_xl])) / (1 + a * (xl + xr + yd + yu));
 
   return dest_density[arr_coord];
 }
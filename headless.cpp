@@ -0,0 +1,351 @@
+#include "ensemble.h"
+#include "schedule.h"
+#include "snapshot.h"
+#include "solver.h"
+#include "sources.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Runs the CPU solver without a window, driven by a schedule file instead of
+// mouse input, as fast as it will go.
+//
+//   FluidHeadless <schedule> [--n N] [--size W H] [--dt DT] [--steps STEPS] [--threads T] [--relax jacobi|redblack] [--pressure sweeps|multigrid] [--advect semi|maccormack|bfecc] [--fused on|off|auto] [--sparse on|off] [--snapshot FILE] [--snapshot-every K] [--snapshot-format f32|f16] [--snapshot-compress on|off] [--checkpoint FILE] [--checkpoint-every K] [--resume FILE] [--trace FILE] [--invariants K] [--ensemble M] [--diff-range LO HI] [--visc-range LO HI]
+//
+// Command line values override the ones in the schedule file.
+//
+// --fused auto, the default, fuses passes only on grids of at least
+// Solver::fused_min_cells cells; on fuses every size, off none.
+//
+// --snapshot streams density and velocity to FILE every K steps (see
+// snapshot.h). --checkpoint saves a checkpoint to FILE every K steps, or
+// only at the end, and --resume continues a run from one; the resumed run
+// needs the same schedule and options to carry on bit for bit.
+//
+// --trace records every solver stage (see trace.h), prints a per stage
+// summary and writes the timeline to FILE as Chrome trace JSON. Mass,
+// divergence and pressure residual are recorded every K steps, 10 unless
+// --invariants says otherwise.
+//
+// --ensemble runs M independent copies of the schedule as an Ensemble, with
+// diff and visc spread evenly over the given ranges from the first member
+// to the last, and reports the spread of their results. Members always
+// relax red-black with the Sweeps pressure solve and SemiLagrangian
+// advection, so snapshots, checkpoints, solids and the solver method options
+// are rejected.
+
+static void print_usage() {
+  std::cerr << "usage: FluidHeadless <schedule> [--n N] [--size W H] [--dt DT] [--steps STEPS] [--threads T] [--relax jacobi|redblack] [--pressure sweeps|multigrid] [--advect semi|maccormack|bfecc] [--fused on|off|auto] [--sparse on|off] [--snapshot FILE] [--snapshot-every K] [--snapshot-format f32|f16] [--snapshot-compress on|off] [--checkpoint FILE] [--checkpoint-every K] [--resume FILE] [--trace FILE] [--invariants K] [--ensemble M] [--diff-range LO HI] [--visc-range LO HI]" << std::endl;
+}
+
+static double total_density(const float* density, int w, int h) {
+  double mass = 0.0;
+  for (int j = 1; j <= h; j++) {
+    for (int i = 1; i <= w; i++) {
+      mass += density[i + (w + 2) * j];
+    }
+  }
+  return mass;
+}
+
+static int run_ensemble(const Schedule& schedule, int threads, int members, const float diff_range[2], const float visc_range[2], const char* trace_path) {
+  Ensemble e(schedule.width, schedule.height, members, threads);
+  for (int m = 0; m < members; m++) {
+    float t = members > 1 ? (float)m / (members - 1) : 0.0f;
+    e.diff[m] = diff_range[0] + (diff_range[1] - diff_range[0]) * t;
+    e.visc[m] = visc_range[0] + (visc_range[1] - visc_range[0]) * t;
+  }
+
+  SourceBatch sources(e.width(), e.height());
+  if (trace_path) trace_start();
+  int steals = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (int step = 0; step < schedule.steps; step++) {
+    e.clear_sources();
+    sources.clear();
+    schedule.apply(sources, step);
+    for (int m = 0; m < members; m++) sources.apply(e, m);
+    e.step(schedule.dt);
+    steals += e.steals();
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+  if (trace_path) trace_stop();
+
+  double low = 0.0, high = 0.0;
+  int low_member = 0, high_member = 0;
+  for (int m = 0; m < members; m++) {
+    double mass = total_density(e.density(m), e.width(), e.height());
+    if (m == 0 || mass < low) {
+      low = mass;
+      low_member = m;
+    }
+    if (m == 0 || mass > high) {
+      high = mass;
+      high_member = m;
+    }
+  }
+
+  double member_steps = (double)schedule.steps * members;
+  std::cout << "grid: " << e.width() << "x" << e.height() << ", members: " << members << ", threads: " << e.thread_count() << ", simd: " << simd_level_name(simd_level()) << std::endl;
+  std::cout << "steps: " << schedule.steps << " in " << seconds << " s" << std::endl;
+  std::cout << "member steps/sec: " << (seconds > 0 ? member_steps / seconds : 0.0) << std::endl;
+  std::cout << "members stolen: " << steals << std::endl;
+  std::cout << "total density: " << low << " (member " << low_member << ") to " << high << " (member " << high_member << ")" << std::endl;
+
+  if (trace_path) {
+    trace_write_summary(std::cout);
+    std::string error;
+    if (!trace_write_chrome(trace_path, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+  if (argc < 2) {
+    print_usage();
+    return 1;
+  }
+
+  Schedule schedule;
+  std::string error;
+  if (!schedule.load(argv[1], error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+
+  int threads = 0;
+  Solver::Relaxation relaxation = Solver::RedBlack;
+  Solver::PressureMethod pressure_method = Solver::Sweeps;
+  Solver::Advection advection = Solver::SemiLagrangian;
+  bool fused = true;
+  bool fuse_all_sizes = false;
+  bool sparse = false;
+  const char* snapshot_path = nullptr;
+  SnapshotOptions snapshot_options;
+  const char* checkpoint_path = nullptr;
+  int checkpoint_every = 0;
+  const char* resume_path = nullptr;
+  const char* trace_path = nullptr;
+  int invariants_every = 10;
+  int ensemble_members = 0;
+  // Last of --relax, --pressure, --advect, --fused and --sparse given.
+  const char* method_option = nullptr;
+  float diff_range[2] = { 0.0003f, 0.0003f };
+  float visc_range[2] = { 0.0f, 0.0f };
+
+  for (int i = 2; i < argc; i++) {
+    if (i + 1 >= argc) {
+      print_usage();
+      return 1;
+    }
+
+    if (std::strcmp(argv[i], "--n") == 0) schedule.width = schedule.height = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--size") == 0 && i + 2 < argc) {
+      schedule.width = std::atoi(argv[++i]);
+      schedule.height = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--dt") == 0) schedule.dt = (float)std::atof(argv[++i]);
+    else if (std::strcmp(argv[i], "--steps") == 0) schedule.steps = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--threads") == 0) threads = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--pressure") == 0) {
+      method_option = argv[i];
+      const char* method = argv[++i];
+      if (std::strcmp(method, "sweeps") == 0) pressure_method = Solver::Sweeps;
+      else if (std::strcmp(method, "multigrid") == 0) pressure_method = Solver::Multigrid;
+      else {
+        print_usage();
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--advect") == 0) {
+      method_option = argv[i];
+      const char* scheme = argv[++i];
+      if (std::strcmp(scheme, "semi") == 0) advection = Solver::SemiLagrangian;
+      else if (std::strcmp(scheme, "maccormack") == 0) advection = Solver::MacCormack;
+      else if (std::strcmp(scheme, "bfecc") == 0) advection = Solver::Bfecc;
+      else {
+        print_usage();
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--relax") == 0) {
+      method_option = argv[i];
+      const char* method = argv[++i];
+      if (std::strcmp(method, "jacobi") == 0) relaxation = Solver::Jacobi;
+      else if (std::strcmp(method, "redblack") == 0) relaxation = Solver::RedBlack;
+      else {
+        print_usage();
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--fused") == 0) {
+      method_option = argv[i];
+      const char* mode = argv[++i];
+      if (std::strcmp(mode, "on") == 0) {
+        fused = true;
+        fuse_all_sizes = true;
+      } else if (std::strcmp(mode, "off") == 0) fused = false;
+      else if (std::strcmp(mode, "auto") == 0) {
+        fused = true;
+        fuse_all_sizes = false;
+      } else {
+        print_usage();
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--sparse") == 0) {
+      method_option = argv[i];
+      const char* mode = argv[++i];
+      if (std::strcmp(mode, "on") == 0) sparse = true;
+      else if (std::strcmp(mode, "off") == 0) sparse = false;
+      else {
+        print_usage();
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--snapshot") == 0) snapshot_path = argv[++i];
+    else if (std::strcmp(argv[i], "--snapshot-every") == 0) snapshot_options.every = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--snapshot-format") == 0) {
+      const char* format = argv[++i];
+      if (std::strcmp(format, "f32") == 0) snapshot_options.half = false;
+      else if (std::strcmp(format, "f16") == 0) snapshot_options.half = true;
+      else {
+        print_usage();
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--snapshot-compress") == 0) {
+      const char* mode = argv[++i];
+      if (std::strcmp(mode, "on") == 0) snapshot_options.compress = true;
+      else if (std::strcmp(mode, "off") == 0) snapshot_options.compress = false;
+      else {
+        print_usage();
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--checkpoint") == 0) checkpoint_path = argv[++i];
+    else if (std::strcmp(argv[i], "--checkpoint-every") == 0) checkpoint_every = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--resume") == 0) resume_path = argv[++i];
+    else if (std::strcmp(argv[i], "--trace") == 0) trace_path = argv[++i];
+    else if (std::strcmp(argv[i], "--invariants") == 0) invariants_every = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--ensemble") == 0) ensemble_members = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--diff-range") == 0 && i + 2 < argc) {
+      diff_range[0] = (float)std::atof(argv[++i]);
+      diff_range[1] = (float)std::atof(argv[++i]);
+    } else if (std::strcmp(argv[i], "--visc-range") == 0 && i + 2 < argc) {
+      visc_range[0] = (float)std::atof(argv[++i]);
+      visc_range[1] = (float)std::atof(argv[++i]);
+    }
+    else {
+      print_usage();
+      return 1;
+    }
+  }
+
+  if (schedule.width <= 0 || schedule.height <= 0 || schedule.dt <= 0 || schedule.steps < 0 || snapshot_options.every < 1 || checkpoint_every < 0 || invariants_every < 0 || ensemble_members < 0) {
+    print_usage();
+    return 1;
+  }
+
+  if (ensemble_members > 0) {
+    if (snapshot_path || checkpoint_path || resume_path || !schedule.solids.empty()) {
+      std::cerr << "--ensemble does not support snapshots, checkpoints or solids" << std::endl;
+      return 1;
+    }
+    if (method_option) {
+      std::cerr << "--ensemble does not support " << method_option << std::endl;
+      return 1;
+    }
+    return run_ensemble(schedule, threads, ensemble_members, diff_range, visc_range, trace_path);
+  }
+
+  Solver s(schedule.width, schedule.height, threads);
+  s.relaxation = relaxation;
+  s.pressure_method = pressure_method;
+  s.advection = advection;
+  s.fused = fused;
+  if (fuse_all_sizes) s.fused_min_cells = 0;
+  s.sparse = sparse;
+  s.invariants_every = invariants_every;
+
+  ObstacleMap obstacles(s.width(), s.height());
+  schedule.add_obstacles(obstacles);
+  s.set_obstacles(obstacles);
+
+  int64_t first_step = 0;
+  if (resume_path && !load_checkpoint(resume_path, s, first_step, error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+
+  SnapshotWriter snapshots;
+  if (snapshot_path && !snapshots.open(snapshot_path, s.width(), s.height(), snapshot_options, error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+
+  SourceBatch sources(s.width(), s.height());
+  if (trace_path) {
+    if (!FLUID_TRACE) std::cerr << "built with FLUID_TRACE=0, the trace will be empty" << std::endl;
+    trace_start();
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (int64_t step = first_step; step < schedule.steps; step++) {
+    s.clear_sources();
+    sources.clear();
+    schedule.apply(sources, (int)step);
+    sources.apply(s);
+    s.step(schedule.dt);
+
+    snapshots.submit(s, step + 1);
+    bool last = step + 1 == schedule.steps;
+    if (checkpoint_path && (last || (checkpoint_every > 0 && (step + 1) % checkpoint_every == 0))) {
+      if (!save_checkpoint(checkpoint_path, s, step + 1, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  if (trace_path) trace_stop();
+
+  if (!snapshots.close(error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  double seconds = std::chrono::duration<double>(end - start).count();
+
+  double mass = total_density(s.density(), s.width(), s.height());
+
+  std::cout << "grid: " << s.width() << "x" << s.height() << ", threads: " << s.thread_count() << ", simd: " << simd_level_name(simd_level()) << std::endl;
+  int64_t steps_run = schedule.steps > first_step ? schedule.steps - first_step : 0;
+  if (resume_path) std::cout << "resumed at step " << first_step << std::endl;
+  std::cout << "steps: " << steps_run << " in " << seconds << " s" << std::endl;
+  std::cout << "steps/sec: " << (seconds > 0 ? steps_run / seconds : 0.0) << std::endl;
+  std::cout << "total density: " << mass << std::endl;
+  if (snapshot_path) {
+    std::cout << "snapshots: " << snapshots.written() << " written, " << snapshots.dropped() << " dropped" << std::endl;
+  }
+  if (s.sparse) {
+    std::cout << "active tiles: " << s.active_tiles() << " of " << s.total_tiles() << std::endl;
+  }
+  if (s.pressure_solve_method() == Solver::Multigrid) {
+    std::cout << "last pressure solve: " << s.pressure_iterations() << " iterations, residual " << s.pressure_residual() << std::endl;
+  }
+
+  if (trace_path) {
+    trace_write_summary(std::cout);
+    if (trace_overwritten() > 0) std::cout << "trace: oldest " << trace_overwritten() << " events overwritten" << std::endl;
+    if (!trace_write_chrome(trace_path, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -1,23 +1,25 @@
 #include "raylib.h"
 #include "rlgl.h"
-#include "solver.h"
+#include "obstacles.h"
+#include "sources.h"
+#include "trace.h"
 #include "raymath.h"
 #include "glad.h"
 
 #include <algorithm>
-#include <array>
-#include <memory>
-
-constexpr int N = 200;
-constexpr int fl_array_size = (N + 2) * (N + 2);
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Grid size, chosen at startup: Fluid [width [height]]
+int grid_width = 200;
+int grid_height = 200;
+int fl_array_size = (grid_width + 2) * (grid_height + 2);
 constexpr int scale_factor = 4;
 
-typedef std::unique_ptr<std::array<float, fl_array_size>> float_array_ptr;
-
+typedef std::vector<float> float_array;
 
-constexpr inline int fl_index(int x, int y) {
-  return ((x) + (N + 2) * (y));
-}
 
 Color floatToColor(float number) {
   if (number > 1) number = 1;
@@ -29,27 +31,125 @@ std::ostream& operator<<(std::ostream& stream, const Color& color) {
   return stream;
 }
 
-void add_liquid_point(const float_array_ptr& dest, int x, int y, int radius) {
-  for (int i = x - radius; i < x + radius; i++) {
-    for (int j = y - radius; j < y + radius; j++) {
-      (*dest)[fl_index(i, j)] += 50.0f;
-    }
-  }
+void add_liquid_point(SourceBatch& sources, int x, int y, int radius) {
+  sources.add_square(SourceBatch::Density, x, y, radius, 50.0f);
+}
+
+void add_force(SourceBatch& sources, int x, int y, float force_x, float force_y) {
+  sources.add(SourceBatch::VelocityU, x, y, force_x);
+  sources.add(SourceBatch::VelocityV, x, y, force_y);
+}
+
+// Zeroes a shader buffer on the GPU, without sending anything from the host.
+void clear_shader_buffer(unsigned int buffer) {
+  float zero = 0.0f;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, &zero);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
-void add_force(const float_array_ptr& dest, int x, int y, int magnitude) {
-  (*dest)[fl_index(x, y)] += magnitude;
+// Uploads only the cells the batch touches, one call per run of consecutive
+// cells, on top of source buffers that have just been cleared.
+void upload_sources(const SourceBatch& sources, const unsigned int buffers[3]) {
+  static std::vector<SourceBatch::Run> runs;
+  static float_array values;
+
+  sources.runs(runs, values);
+  for (const SourceBatch::Run& run : runs) {
+    rlUpdateShaderBuffer(buffers[run.field], values.data() + run.offset, run.count * sizeof(float), run.first * sizeof(float));
+  }
 }
 
+// GPU side of the trace. Each dispatch is bracketed by timestamp queries
+// that are read back frames_in_flight frames later, when the GPU has long
+// finished them, so timing never makes the CPU wait for the GPU. GPU time
+// is moved onto the trace clock by an offset measured once in start.
+struct GpuTimeline {
+  static const int frames_in_flight = 3;
+  static const int max_stages = 32;
+
+  unsigned int queries[frames_in_flight][2 * max_stages];
+  const char* names[frames_in_flight][max_stages];
+  int counts[frames_in_flight] = {};
+  int frame = 0;
+  int64_t offset_ns = 0;
+  bool started = false;
+  // GPU time of the last frame read back, first dispatch to last.
+  double frame_ms = 0.0;
+
+  void start() {
+    glGenQueries(frames_in_flight * 2 * max_stages, &queries[0][0]);
+    GLint64 gpu_now = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+    offset_ns = trace_now_ns() - gpu_now;
+    started = true;
+  }
+
+  // Reads back the frame that last used this frame's queries.
+  void begin_frame() {
+    if (!started) return;
+    int slot = frame % frames_in_flight;
+    int count = counts[slot];
+    counts[slot] = 0;
+    if (count == 0) return;
+
+    GLint available = 0;
+    glGetQueryObjectiv(queries[slot][2 * count - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return;
+
+    GLuint64 first = 0, last = 0;
+    for (int k = 0; k < count; k++) {
+      GLuint64 begin = 0, end = 0;
+      glGetQueryObjectui64v(queries[slot][2 * k], GL_QUERY_RESULT, &begin);
+      glGetQueryObjectui64v(queries[slot][2 * k + 1], GL_QUERY_RESULT, &end);
+      trace_span(names[slot][k], trace_gpu_track, (int64_t)begin + offset_ns, (int64_t)end + offset_ns, (int64_t)grid_width * grid_height);
+      if (k == 0) first = begin;
+      last = end;
+    }
+    trace_span("step", trace_gpu_track, (int64_t)first + offset_ns, (int64_t)last + offset_ns, (int64_t)grid_width * grid_height);
+    frame_ms = (last - first) / 1e6;
+  }
+
+  void end_frame() {
+    if (started) frame++;
+  }
+
+  void begin(const char* name) {
+    int slot = frame % frames_in_flight;
+    if (!started || counts[slot] == max_stages) return;
+    names[slot][counts[slot]] = name;
+    glQueryCounter(queries[slot][2 * counts[slot]], GL_TIMESTAMP);
+  }
+
+  void end() {
+    int slot = frame % frames_in_flight;
+    if (!started || counts[slot] == max_stages) return;
+    glQueryCounter(queries[slot][2 * counts[slot] + 1], GL_TIMESTAMP);
+    counts[slot]++;
+  }
+};
+
+GpuTimeline gpu_timeline;
+
+// The shaders fall back to a 200x200 grid unless W, H and N are defined, so
+// the runtime grid size goes in right after the #version line.
 unsigned int load_compute_shader(const char* filename) {
   char* file = LoadFileText(filename);
-  unsigned int shader = rlCompileShader(file, RL_COMPUTE_SHADER);
-  unsigned int program = rlLoadComputeShaderProgram(shader);
+  std::string source = file;
   UnloadFileText(file);
+
+  std::string defines = TextFormat("#define W %i\n#define H %i\n#define N %i\n", grid_width, grid_height, std::max(grid_width, grid_height));
+  size_t version_end = source.find('\n', source.find("#version"));
+  source.insert(version_end == std::string::npos ? source.size() : version_end + 1, defines);
+
+  unsigned int shader = rlCompileShader(source.c_str(), RL_COMPUTE_SHADER);
+  unsigned int program = rlLoadComputeShaderProgram(shader);
   return program;
 }
 
-void run_compute_shader(unsigned int shader_id, unsigned int buffer1, unsigned int buffer2, unsigned int buffer3, unsigned int buffer4, float* float1, float* float2, int boundary, int iterations) {
+// boundary follows the shaders: 0 for density and pressure, 1 and 2 for the
+// velocity components. name labels the dispatches in traces.
+void run_compute_shader(const char* name, unsigned int shader_id, unsigned int buffer1, unsigned int buffer2, unsigned int buffer3, unsigned int buffer4, float* float1, float* float2, int boundary, int iterations) {
 
   rlEnableShader(shader_id);
 
@@ -60,36 +160,39 @@ void run_compute_shader(unsigned int shader_id, unsigned int buffer1, unsigned i
 
   rlSetUniform(5, float1, RL_SHADER_UNIFORM_FLOAT, 1);
   rlSetUniform(6, float2, RL_SHADER_UNIFORM_FLOAT, 1);
-  
+  rlSetUniform(7, &boundary, RL_SHADER_UNIFORM_INT, 1);
+
+  gpu_timeline.begin(name);
   for (int i = 0; i < iterations; i++) {
-    rlComputeShaderDispatch(N, N, 1);
+    rlComputeShaderDispatch(grid_width, grid_height, 1);
     glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
   }
+  gpu_timeline.end();
 }
 
+// With FLUID_TRACE_OUT=<file> in the environment, every frame and GPU
+// dispatch is traced (see trace.h) and the timeline is written to the file
+// as Chrome trace JSON on exit.
 int main (int argc, char *argv[]) {
 
-  float_array_ptr vely = std::make_unique<std::array<float, fl_array_size>>();
-  float_array_ptr velx = std::make_unique<std::array<float, fl_array_size>>();
-  float_array_ptr prev_velx = std::make_unique<std::array<float, fl_array_size>>();
-  float_array_ptr prev_vely = std::make_unique<std::array<float, fl_array_size>>();
-  float_array_ptr density = std::make_unique<std::array<float, fl_array_size>>();
-  float_array_ptr prev_density = std::make_unique<std::array<float, fl_array_size>>();
-  float_array_ptr contents = std::make_unique<std::array<float, fl_array_size>>();
-  contents->fill(0.0);
-  density->fill(0.0);
-  prev_velx->fill(0.0);
-  prev_vely->fill(0.0);
-
-  auto s = Solver();
-
-  InitWindow((N+2) * scale_factor, (N+2) * scale_factor, "Fluid Window!");
+  if (argc > 1) grid_width = std::atoi(argv[1]);
+  grid_height = argc > 2 ? std::atoi(argv[2]) : grid_width;
+  if (grid_width <= 0 || grid_height <= 0) {
+    std::cerr << "usage: Fluid [width [height]]" << std::endl;
+    return 1;
+  }
+  fl_array_size = (grid_width + 2) * (grid_height + 2);
+
+  float_array density(fl_array_size, 0.0f);
+  SourceBatch sources(grid_width, grid_height);
+
+  InitWindow((grid_width + 2) * scale_factor, (grid_height + 2) * scale_factor, "Fluid Window!");
   SetTargetFPS(60);
   
   Texture2D density_texture = {
-    rlLoadTexture(density->data(), N + 2, N + 2, PIXELFORMAT_UNCOMPRESSED_R32, 1),
-    N + 2,
-    N + 2,
+    rlLoadTexture(density.data(), grid_width + 2, grid_height + 2, PIXELFORMAT_UNCOMPRESSED_R32, 1),
+    grid_width + 2,
+    grid_height + 2,
     1,
     PIXELFORMAT_UNCOMPRESSED_R32
   };
@@ -98,19 +201,32 @@ int main (int argc, char *argv[]) {
   glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &ist);
 
   Texture2D compute_texture = {
-    rlLoadTexture(nullptr, (N + 2), (N + 2), PIXELFORMAT_UNCOMPRESSED_R32G32B32A32, 1),
-    N+2,
-    N+2,
+    rlLoadTexture(nullptr, (grid_width + 2), (grid_height + 2), PIXELFORMAT_UNCOMPRESSED_R32G32B32A32, 1),
+    grid_width + 2,
+    grid_height + 2,
     1,
     RL_PIXELFORMAT_UNCOMPRESSED_R32G32B32
   };
 
-  Texture2D boundaries = LoadTexture("map.png");
+  // Obstacles: the flags are built once from map.png and stay bound to
+  // buffer 8 for every shader.
+
+  ObstacleMap obstacles(grid_width, grid_height);
+  Image map = LoadImage("map.png");
+  if (map.data) {
+    ImageFormat(&map, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    obstacles.load_rgba((const unsigned char*)map.data, map.width, map.height);
+    UnloadImage(map);
+  }
+
+  std::vector<unsigned char> flags = obstacles.flags();
+  std::vector<unsigned int> flag_words(flags.begin(), flags.end());
+  unsigned int cell_flags = rlLoadShaderBuffer(fl_array_size * sizeof(unsigned int), flag_words.data(), RL_STATIC_DRAW);
+  rlBindShaderBuffer(cell_flags, 8);
 
   // Bind texture
 
   rlBindImageTexture(compute_texture.id, 0, PIXELFORMAT_UNCOMPRESSED_R32G32B32A32, true);
-  rlBindImageTexture(boundaries.id, 7, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, true);
 
   // Create buffers
 
@@ -121,6 +237,9 @@ int main (int argc, char *argv[]) {
   unsigned int fluid_velocity_up = rlLoadShaderBuffer(fl_array_size * sizeof(float), NULL, RL_DYNAMIC_COPY);
   unsigned int fluid_velocity_vp = rlLoadShaderBuffer(fl_array_size * sizeof(float), NULL, RL_DYNAMIC_COPY);
 
+  // Indexed by SourceBatch::Field.
+  const unsigned int source_buffers[3] = { fluid_density_previous, fluid_velocity_up, fluid_velocity_vp };
+
 
 
   Vector2 first_pressed = Vector2{};
@@ -128,7 +247,7 @@ int main (int argc, char *argv[]) {
   // Load Diffuse Compute
 
 
-  rlUpdateShaderBuffer(fluid_density_previous, density->data(), fl_array_size * sizeof(float), 0
+  rlUpdateShaderBuffer(fluid_density_previous, density.data(), fl_array_size * sizeof(float), 0
   );
 
   unsigned int diffuse_compute_program = load_compute_shader("fluid_compute.glsl");
@@ -141,21 +260,25 @@ int main (int argc, char *argv[]) {
   float diff = 0.0003f;
   float visc = 0.0f;
 
+  const char* trace_out = FLUID_TRACE ? std::getenv("FLUID_TRACE_OUT") : nullptr;
+  if (trace_out) {
+    trace_start();
+    gpu_timeline.start();
+  }
 
   while (!WindowShouldClose()) {
+    FLUID_TRACE_SCOPE("frame", (int64_t)grid_width * grid_height);
+    gpu_timeline.begin_frame();
 
     float dt = GetFrameTime();
 
-    prev_velx->fill(0.0);
-    prev_vely->fill(0.0);
-    prev_density->fill(0.0);
-    rlUpdateShaderBuffer(fluid_density_previous, prev_density->data(), fl_array_size * sizeof(float), 0);
-    rlUpdateShaderBuffer(fluid_velocity_up, prev_velx->data(), fl_array_size * sizeof(float), 0);
-    rlUpdateShaderBuffer(fluid_velocity_vp, prev_vely->data(), fl_array_size * sizeof(float), 0);
-
+    // The source buffers are used as scratch by the previous frame, so they
+    // are cleared on the device and only the input is sent across.
+    sources.clear();
+    for (unsigned int buffer : source_buffers) clear_shader_buffer(buffer);
 
     if (IsMouseButtonDown(MOUSE_LEFT_BUTTON)) {
-      add_liquid_point(prev_density, GetMousePosition().x / scale_factor, GetMousePosition().y / scale_factor, 1);
+      add_liquid_point(sources, GetMousePosition().x / scale_factor, GetMousePosition().y / scale_factor, 1);
     }
 
     if (IsMouseButtonPressed(MOUSE_RIGHT_BUTTON)) {
@@ -166,19 +289,16 @@ int main (int argc, char *argv[]) {
     if (IsMouseButtonReleased(MOUSE_RIGHT_BUTTON)) {
       Vector2 force = Vector2Scale(Vector2Subtract(first_pressed, GetMousePosition()), -80);
       std::cout << force.x << force.y << std::endl;
-      add_force(prev_velx, first_pressed.x / scale_factor, first_pressed.y / scale_factor, force.x);
-      add_force(prev_vely, first_pressed.x / scale_factor, first_pressed.y / scale_factor, force.y);
+      add_force(sources, first_pressed.x / scale_factor, first_pressed.y / scale_factor, force.x, force.y);
     }
 
-    rlUpdateShaderBuffer(fluid_density_previous, prev_density->data(), fl_array_size * sizeof(float), 0);
-    rlUpdateShaderBuffer(fluid_velocity_up, prev_velx->data(), fl_array_size * sizeof(float), 0);
-    rlUpdateShaderBuffer(fluid_velocity_vp, prev_vely->data(), fl_array_size * sizeof(float), 0);
+    upload_sources(sources, source_buffers);
 
     // Velocity Step
 
     // Add sources
 
-    run_compute_shader(add_compute_program,
+    run_compute_shader("add_source", add_compute_program,
       fluid_velocity_up,
       fluid_velocity_u,
       0,
@@ -186,7 +306,7 @@ int main (int argc, char *argv[]) {
       &dt,
       nullptr, 0, 1);
 
-    run_compute_shader(add_compute_program,
+    run_compute_shader("add_source", add_compute_program,
       fluid_velocity_vp,
       fluid_velocity_v,
       0,
@@ -196,7 +316,7 @@ int main (int argc, char *argv[]) {
 
     // Diffuse
 
-    run_compute_shader(diffuse_compute_program,
+    run_compute_shader("diffuse", diffuse_compute_program,
       fluid_velocity_u,
       fluid_velocity_up,
       0,
@@ -204,7 +324,7 @@ int main (int argc, char *argv[]) {
       &dt,
       &visc, 1, 20);
 
-    run_compute_shader(diffuse_compute_program,
+    run_compute_shader("diffuse", diffuse_compute_program,
       fluid_velocity_v,
       fluid_velocity_vp,
       0,
@@ -214,7 +334,7 @@ int main (int argc, char *argv[]) {
 
     // Project
 
-    run_compute_shader(project_compute_program_a,
+    run_compute_shader("divergence", project_compute_program_a,
       fluid_velocity_up,
       fluid_velocity_vp,
       fluid_velocity_u,
@@ -222,7 +342,7 @@ int main (int argc, char *argv[]) {
       nullptr,
       nullptr, 0, 1);
 
-    run_compute_shader(project_compute_program_b,
+    run_compute_shader("pressure_solve", project_compute_program_b,
       fluid_velocity_up,
       fluid_velocity_vp,
       fluid_velocity_u,
@@ -230,7 +350,7 @@ int main (int argc, char *argv[]) {
       nullptr,
       nullptr, 0, 20);
 
-    run_compute_shader(project_compute_program_c,
+    run_compute_shader("subtract_gradient", project_compute_program_c,
       fluid_velocity_up,
       fluid_velocity_vp,
       fluid_velocity_u,
@@ -240,7 +360,7 @@ int main (int argc, char *argv[]) {
 
     // Advect
 
-    run_compute_shader(advect_compute_program,
+    run_compute_shader("advect", advect_compute_program,
       fluid_velocity_up,
       fluid_velocity_u,
       fluid_velocity_up,
@@ -248,7 +368,7 @@ int main (int argc, char *argv[]) {
       &dt,
       &visc, 1, 1);
 
-    run_compute_shader(advect_compute_program,
+    run_compute_shader("advect", advect_compute_program,
       fluid_velocity_vp,
       fluid_velocity_v,
       fluid_velocity_up,
@@ -258,7 +378,7 @@ int main (int argc, char *argv[]) {
 
     // Project
 
-    run_compute_shader(project_compute_program_a,
+    run_compute_shader("divergence", project_compute_program_a,
       fluid_velocity_u,
       fluid_velocity_v,
       fluid_velocity_up,
@@ -266,7 +386,7 @@ int main (int argc, char *argv[]) {
       nullptr,
       nullptr, 0, 1);
 
-    run_compute_shader(project_compute_program_b,
+    run_compute_shader("pressure_solve", project_compute_program_b,
       fluid_velocity_u,
       fluid_velocity_v,
       fluid_velocity_up,
@@ -274,11 +394,11 @@ int main (int argc, char *argv[]) {
       nullptr,
       nullptr, 0, 20);
 
-    run_compute_shader(project_compute_program_c,
-      fluid_velocity_up,
-      fluid_velocity_vp,
+    run_compute_shader("subtract_gradient", project_compute_program_c,
       fluid_velocity_u,
       fluid_velocity_v,
+      fluid_velocity_up,
+      fluid_velocity_vp,
       nullptr,
       nullptr, 0, 1);
 
@@ -287,7 +407,7 @@ int main (int argc, char *argv[]) {
 
     // Add Source
 
-    run_compute_shader(add_compute_program,
+    run_compute_shader("add_source", add_compute_program,
       fluid_density_previous,
       fluid_density_current,
       0,
@@ -297,7 +417,7 @@ int main (int argc, char *argv[]) {
 
     //Diffuse
 
-    run_compute_shader(diffuse_compute_program,
+    run_compute_shader("diffuse", diffuse_compute_program,
       fluid_density_current,
       fluid_density_previous,
       0,
@@ -307,7 +427,7 @@ int main (int argc, char *argv[]) {
 
     // Advect
 
-    run_compute_shader(advect_compute_program,
+    run_compute_shader("advect", advect_compute_program,
       fluid_density_previous,
       fluid_density_current,
       fluid_velocity_u,
@@ -315,20 +435,32 @@ int main (int argc, char *argv[]) {
       &dt,
       &diff, 0, 1);
 
+    gpu_timeline.end_frame();
+
     BeginDrawing();
     ClearBackground(RAYWHITE);
     
-    DrawTexturePro(compute_texture, { 0,0,N + 2,N + 2 }, { 0,0,(N + 2) * scale_factor, (N + 2) * scale_factor }, { 0,0 }, 0, RAYWHITE);
+    DrawTexturePro(compute_texture, { 0, 0, (float)(grid_width + 2), (float)(grid_height + 2) }, { 0, 0, (float)((grid_width + 2) * scale_factor), (float)((grid_height + 2) * scale_factor) }, { 0,0 }, 0, RAYWHITE);
 
     DrawText(TextFormat("FPS: %i", (int)(1.0f / dt)), 40, 40, 20, GREEN);
     DrawText(TextFormat("Left click to add dye"), 40, 70, 20, GREEN);
     DrawText(TextFormat("Right click, hold and release to add forces at a point"), 40, 100, 20, GREEN);
+    if (trace_out) DrawText(TextFormat("GPU step: %.2f ms", gpu_timeline.frame_ms), 40, 130, 20, GREEN);
 
 
     EndDrawing();
   }
 
   CloseWindow();
+
+  if (trace_out) {
+    trace_stop();
+    std::string error;
+    if (!trace_write_chrome(trace_out, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
   return 0;
 }
 
@@ -22,7 +22,7 @@ project "Fluid"
   buildoptions { "-std=c++17" }
   defines {"GRAPHICS=GRAPHICS_API_OPENGL_43"}
 
-  files { "**.h", "**.cpp" }
+  files { "main.cpp", "src/**.h", "src/**.cpp" }
 
   filter "configurations:Debug"
     defines { "DEBUG" }
@@ -39,5 +39,44 @@ project "Fluid"
   filter "system:macosx"
     linkoptions { "-rpath @executable_path/../../external/raylib/lib"}
 
+project "FluidHeadless"
+  kind "ConsoleApp"
+  language "C++"
+  targetdir "build/%{cfg.buildcfg}"
+  includedirs { "src/" }
+  buildoptions { "-std=c++17" }
+
+  files { "headless.cpp", "src/**.h", "src/**.cpp" }
+
+  filter "configurations:Debug"
+    defines { "DEBUG" }
+    symbols "On"
+
+  filter "configurations:Release"
+    defines { "NDEBUG" }
+    optimize "Speed"
+    symbols "On"
+
+  filter "system:linux"
+    links { "pthread" }
 
+project "FluidBench"
+  kind "ConsoleApp"
+  language "C++"
+  targetdir "build/%{cfg.buildcfg}"
+  includedirs { "src/" }
+  buildoptions { "-std=c++17" }
+
+  files { "bench.cpp", "src/**.h", "src/**.cpp" }
+
+  filter "configurations:Debug"
+    defines { "DEBUG" }
+    symbols "On"
+
+  filter "configurations:Release"
+    defines { "NDEBUG" }
+    optimize "Speed"
+    symbols "On"
 
+  filter "system:linux"
+    links { "pthread" }
@@ -22,8 +22,21 @@ layout(std430, binding = 4) buffer vel_prev_u_layout {
 layout(location = 5) uniform float dt;
 layout(location = 6) uniform float diff;
 
+// ObstacleMap flags of every cell, uploaded once by main.cpp: bit 0 is set
+// for fluid cells, bits 1-4 when the left, right, lower and upper neighbour
+// is open.
+layout(std430, binding = 8) buffer flags_layout {
+  uint cell_flags[];
+};
+
+// Grid size, injected by load_compute_shader. W x H interior cells, N is the
+// grid scale (1 / cell size).
+#ifndef W
+#define W 200
+#define H 200
 #define N 200
-#define IX(i,j) ((i)+(N+2)*(j))
+#endif
+#define IX(i,j) ((i)+(W+2)*(j))
 
 float project(vec4 value, ivec2 texel_coord) {
 
@@ -31,7 +44,8 @@ float project(vec4 value, ivec2 texel_coord) {
   int x = texel_coord.x;
   int y = texel_coord.y;
 
-  vel_prev_v[IX(x, y)] = -0.5 * h * (vel_u[IX(x + 1, y)] - vel_u[IX(x - 1, y)] + vel_v[IX(x, y + 1)] - vel_v[IX(x, y - 1)]);
+  float fluid = float(cell_flags[IX(x, y)] & 1u);
+  vel_prev_v[IX(x, y)] = fluid * -0.5 * h * (vel_u[IX(x + 1, y)] - vel_u[IX(x - 1, y)] + vel_v[IX(x, y + 1)] - vel_v[IX(x, y - 1)]);
   vel_prev_u[IX(x, y)] = 0;
 
   return vel_prev_v[IX(x, y)];
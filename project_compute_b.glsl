@@ -22,14 +22,36 @@ layout(std430, binding = 4) buffer vel_prev_u_layout {
 layout(location = 5) uniform float dt;
 layout(location = 6) uniform float diff;
 
+// ObstacleMap flags of every cell, uploaded once by main.cpp: bit 0 is set
+// for fluid cells, bits 1-4 when the left, right, lower and upper neighbour
+// is open.
+layout(std430, binding = 8) buffer flags_layout {
+  uint cell_flags[];
+};
+
+// Grid size, injected by load_compute_shader. W x H interior cells, N is the
+// grid scale (1 / cell size).
+#ifndef W
+#define W 200
+#define H 200
 #define N 200
-#define IX(i,j) ((i)+(N+2)*(j))
+#endif
+#define IX(i,j) ((i)+(W+2)*(j))
 
 float project(vec4 value, ivec2 texel_coord) {
 
   int x = texel_coord.x;
   int y = texel_coord.y;
-  p[IX(x, y)] = (div[IX(x, y)] + p[IX(x - 1, y)] + p[IX(x + 1, y)] + p[IX(x, y - 1)] + p[IX(x, y + 1)]) / 4.0f;
+  // Walls reflect the cell's own pressure, so it relaxes towards the average
+  // of its open neighbours only. Solid cells stay at zero.
+  uint flags = cell_flags[IX(x, y)];
+  float fluid = float(flags & 1u);
+  float xl = float((flags >> 1) & 1u);
+  float xr = float((flags >> 2) & 1u);
+  float yd = float((flags >> 3) & 1u);
+  float yu = float((flags >> 4) & 1u);
+
+  p[IX(x, y)] = fluid * (div[IX(x, y)] + xl * p[IX(x - 1, y)] + xr * p[IX(x + 1, y)] + yd * p[IX(x, y - 1)] + yu * p[IX(x, y + 1)]) / max(xl + xr + yd + yu, 1.0);
 
   return p[IX(x, y)];
 }
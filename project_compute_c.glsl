@@ -22,8 +22,21 @@ layout(std430, binding = 4) buffer vel_prev_u_layout {
 layout(location = 5) uniform float dt;
 layout(location = 6) uniform float diff;
 
+// ObstacleMap flags of every cell, uploaded once by main.cpp: bit 0 is set
+// for fluid cells, bits 1-4 when the left, right, lower and upper neighbour
+// is open.
+layout(std430, binding = 8) buffer flags_layout {
+  uint cell_flags[];
+};
+
+// Grid size, injected by load_compute_shader. W x H interior cells, N is the
+// grid scale (1 / cell size).
+#ifndef W
+#define W 200
+#define H 200
 #define N 200
-#define IX(i,j) ((i)+(N+2)*(j))
+#endif
+#define IX(i,j) ((i)+(W+2)*(j))
 
 float project(vec4 value, ivec2 texel_coord) {
 
@@ -32,8 +45,18 @@ float project(vec4 value, ivec2 texel_coord) {
   int x = texel_coord.x;
   int y = texel_coord.y;
 
-  vel_u[IX(x, y)] = vel_u[IX(x, y)] - (0.5 * (p[IX(x + 1, y)] - p[IX(x - 1, y)]) / h);
-  vel_v[IX(x, y)] = vel_v[IX(x, y)] - (0.5 * (p[IX(x, y + 1)] - p[IX(x, y - 1)]) / h);
+  // A wall neighbour takes the cell's own pressure, so no flow is driven
+  // through it.
+  uint flags = cell_flags[IX(x, y)];
+  float fluid = float(flags & 1u);
+  float p_here = p[IX(x, y)];
+  float p_xl = mix(p_here, p[IX(x - 1, y)], float((flags >> 1) & 1u));
+  float p_xr = mix(p_here, p[IX(x + 1, y)], float((flags >> 2) & 1u));
+  float p_yd = mix(p_here, p[IX(x, y - 1)], float((flags >> 3) & 1u));
+  float p_yu = mix(p_here, p[IX(x, y + 1)], float((flags >> 4) & 1u));
+
+  vel_u[IX(x, y)] = vel_u[IX(x, y)] - fluid * (0.5 * (p_xr - p_xl) / h);
+  vel_v[IX(x, y)] = vel_v[IX(x, y)] - fluid * (0.5 * (p_yu - p_yd) / h);
 
   return vel_u[IX(x, y)];
 }
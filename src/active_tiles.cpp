@@ -0,0 +1,140 @@
+#include "active_tiles.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+ActiveTiles::ActiveTiles(int w, int h, ThreadPool& pool) :
+  w(w),
+  h(h),
+  tiles_x((w + tile_size - 1) / tile_size),
+  tiles_y((h + tile_size - 1) / tile_size),
+  pool(pool),
+  active(tiles_x * tiles_y, 1),
+  covered(tiles_x * tiles_y, 1) {
+
+}
+
+void ActiveTiles::mark_all() {
+  if (std::find(active.begin(), active.end(), 0) == active.end()) return;
+  std::fill(active.begin(), active.end(), 1);
+  stale = true;
+}
+
+void ActiveTiles::mark_nonzero(const float* field) {
+  int stride = w + 2;
+
+  // Tile rows are split between threads, so no two threads write the same
+  // entry of active.
+  pool.parallel_rows(0, tiles_y, [&](int row_begin, int row_end) {
+    for (int ty = row_begin; ty < row_end; ty++) {
+      for (int tx = 0; tx < tiles_x; tx++) {
+        unsigned char& tile = active[tx + tiles_x * ty];
+        int i_end = std::min(w, (tx + 1) * tile_size);
+        int j_end = std::min(h, (ty + 1) * tile_size);
+        for (int j = ty * tile_size + 1; j <= j_end && !tile; j++) {
+          for (int i = tx * tile_size + 1; i <= i_end; i++) {
+            if (field[i + stride * j] != 0.0f) {
+              tile = 1;
+              break;
+            }
+          }
+        }
+      }
+    }
+  });
+
+  stale = true;
+}
+
+void ActiveTiles::mark_cell(int k) {
+  int i = k % (w + 2);
+  int j = k / (w + 2);
+  unsigned char& tile = active[(i - 1) / tile_size + tiles_x * ((j - 1) / tile_size)];
+  if (tile) return;
+  tile = 1;
+  stale = true;
+}
+
+const std::vector<RowSpan>& ActiveTiles::rows() {
+  if (stale) build_rows();
+  return spans;
+}
+
+void ActiveTiles::build_rows() {
+  std::fill(covered.begin(), covered.end(), 0);
+
+  for (int ty = 0; ty < tiles_y; ty++) {
+    for (int tx = 0; tx < tiles_x; tx++) {
+      if (!active[tx + tiles_x * ty]) continue;
+      for (int y = std::max(0, ty - 1); y <= std::min(tiles_y - 1, ty + 1); y++) {
+        for (int x = std::max(0, tx - 1); x <= std::min(tiles_x - 1, tx + 1); x++) {
+          covered[x + tiles_x * y] = 1;
+        }
+      }
+    }
+  }
+
+  spans.clear();
+  for (int ty = 0; ty < tiles_y; ty++) {
+    int j_end = std::min(h, (ty + 1) * tile_size);
+    for (int j = ty * tile_size + 1; j <= j_end; j++) {
+      for (int tx = 0; tx < tiles_x; tx++) {
+        if (!covered[tx + tiles_x * ty]) continue;
+        int run = tx;
+        while (run + 1 < tiles_x && covered[run + 1 + tiles_x * ty]) run++;
+        spans.push_back(RowSpan { j, tx * tile_size + 1, std::min(w, (run + 1) * tile_size) + 1 });
+        tx = run;
+      }
+    }
+  }
+
+  stale = false;
+}
+
+void ActiveTiles::update(float threshold, std::initializer_list<float*> fields) {
+  int stride = w + 2;
+
+  pool.parallel_rows(0, tiles_y, [&](int row_begin, int row_end) {
+    for (int ty = row_begin; ty < row_end; ty++) {
+      for (int tx = 0; tx < tiles_x; tx++) {
+        if (!covered[tx + tiles_x * ty]) continue;
+        int i_begin = tx * tile_size + 1;
+        int i_end = std::min(w, (tx + 1) * tile_size) + 1;
+        int j_begin = ty * tile_size + 1;
+        int j_end = std::min(h, (ty + 1) * tile_size) + 1;
+
+        float peak = 0.0f;
+        for (float* field : fields) {
+          for (int j = j_begin; j < j_end; j++) {
+            for (int i = i_begin; i < i_end; i++) {
+              peak = std::max(peak, std::fabs(field[i + stride * j]));
+            }
+          }
+        }
+
+        bool keep = peak > threshold;
+        active[tx + tiles_x * ty] = keep;
+        if (keep) continue;
+
+        for (float* field : fields) {
+          for (int j = j_begin; j < j_end; j++) {
+            std::fill(field + i_begin + stride * j, field + i_end + stride * j, 0.0f);
+          }
+        }
+      }
+    }
+  });
+
+  stale = true;
+}
+
+void ActiveTiles::restore(const std::vector<unsigned char>& state) {
+  if (state.size() != active.size()) return;
+  active = state;
+  stale = true;
+}
+
+int ActiveTiles::active_count() const {
+  return (int)std::count(active.begin(), active.end(), 1);
+}
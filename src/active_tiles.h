@@ -0,0 +1,65 @@
+#pragma once
+
+#include <initializer_list>
+#include <vector>
+
+class ThreadPool;
+
+// Cells [col_begin, col_end) of row j.
+struct RowSpan {
+  int j;
+  int col_begin;
+  int col_end;
+};
+
+// Tile level activity map for a (w+2) x (h+2) field, used by Solver to skip
+// the quiescent parts of the grid. The interior is cut into tile_size square
+// tiles (smaller along the far edges). A tile is active while any of the
+// tracked fields exceeds the threshold in it; everything outside the active
+// tiles is kept at exactly zero, so a stage only has to visit the active
+// tiles plus a one tile halo that values can spread into during a step.
+class ActiveTiles {
+public:
+  static const int tile_size = 16;
+
+  ActiveTiles(int w, int h, ThreadPool& pool);
+
+  void mark_all();
+
+  // Activates every tile where field is nonzero. Used for the sources, which
+  // can be written anywhere between steps.
+  void mark_nonzero(const float* field);
+
+  // Activates the tile holding interior cell k, for sources whose cells are
+  // known.
+  void mark_cell(int k);
+
+  // The rows of the active tiles grown by the halo, in order, with one span
+  // per run of adjacent tiles.
+  const std::vector<RowSpan>& rows();
+
+  // After a step, re-evaluates the tiles that rows() covered: a tile stays
+  // active while max |value| over the fields is above threshold, and is
+  // zeroed in every one of them otherwise.
+  void update(float threshold, std::initializer_list<float*> fields);
+
+  int active_count() const;
+
+  // One byte per tile, row by row, 1 where the tile is active. Checkpoints
+  // save it so a sparse run resumes with the same tiles.
+  const std::vector<unsigned char>& state() const { return active; }
+  void restore(const std::vector<unsigned char>& state);
+  int tile_count() const { return tiles_x * tiles_y; }
+
+private:
+  void build_rows();
+
+  int w, h;
+  int tiles_x, tiles_y;
+  ThreadPool& pool;
+  std::vector<unsigned char> active;
+  // Active tiles grown by the halo, the ones rows() covers.
+  std::vector<unsigned char> covered;
+  std::vector<RowSpan> spans;
+  bool stale = true;
+};
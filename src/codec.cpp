@@ -0,0 +1,192 @@
+#include "codec.h"
+
+#include <cstring>
+
+uint16_t float_to_half(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  uint32_t sign = (bits >> 16) & 0x8000;
+  int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+  uint32_t mantissa = bits & 0x7FFFFF;
+
+  if (((bits >> 23) & 0xFF) == 0xFF) {
+    return (uint16_t)(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+  }
+  if (exponent >= 31) return (uint16_t)(sign | 0x7C00);
+
+  if (exponent <= 0) {
+    // Subnormal half, or zero once shifted out entirely.
+    if (exponent < -10) return (uint16_t)sign;
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) half++;
+    return (uint16_t)(sign | half);
+  }
+
+  uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1FFF;
+  // A carry out of the mantissa correctly bumps the exponent, up to infinity.
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+  return (uint16_t)(sign | half);
+}
+
+float half_to_float(uint16_t half) {
+  uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1F;
+  uint32_t mantissa = half & 0x3FF;
+  uint32_t bits;
+
+  if (exponent == 0x1F) {
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // Subnormal half: normalise into a float.
+    exponent = 127 - 15 + 1;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+  }
+
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+void shuffle_bytes(const uint8_t* in, uint8_t* out, int count, int size) {
+  for (int b = 0; b < size; b++) {
+    for (int i = 0; i < count; i++) {
+      out[b * count + i] = in[i * size + b];
+    }
+  }
+}
+
+void unshuffle_bytes(const uint8_t* in, uint8_t* out, int count, int size) {
+  for (int b = 0; b < size; b++) {
+    for (int i = 0; i < count; i++) {
+      out[i * size + b] = in[b * count + i];
+    }
+  }
+}
+
+// Format limits: the last five bytes are always literals and no match
+// starts within the last twelve.
+static const int min_match = 4;
+static const int last_literals = 5;
+static const int match_limit = 12;
+static const int hash_bits = 16;
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t hash4(uint32_t value) {
+  return (value * 2654435761u) >> (32 - hash_bits);
+}
+
+static void put_length(std::vector<uint8_t>& out, int length) {
+  while (length >= 255) {
+    out.push_back(255);
+    length -= 255;
+  }
+  out.push_back((uint8_t)length);
+}
+
+static void put_sequence(std::vector<uint8_t>& out, const uint8_t* literals, int literal_count, int offset, int match_length) {
+  uint8_t token = (uint8_t)((literal_count >= 15 ? 15 : literal_count) << 4);
+  if (match_length > 0) token |= (uint8_t)(match_length - min_match >= 15 ? 15 : match_length - min_match);
+  out.push_back(token);
+  if (literal_count >= 15) put_length(out, literal_count - 15);
+  out.insert(out.end(), literals, literals + literal_count);
+  if (match_length == 0) return;
+  out.push_back((uint8_t)(offset & 0xFF));
+  out.push_back((uint8_t)(offset >> 8));
+  if (match_length - min_match >= 15) put_length(out, match_length - min_match - 15);
+}
+
+void lz_compress(const uint8_t* in, int size, std::vector<uint8_t>& out) {
+  std::vector<int> table(1 << hash_bits, -1);
+  int anchor = 0;
+  int pos = 0;
+
+  while (pos + match_limit < size) {
+    uint32_t sequence = read32(in + pos);
+    uint32_t h = hash4(sequence);
+    int candidate = table[h];
+    table[h] = pos;
+
+    if (candidate < 0 || pos - candidate > 0xFFFF || read32(in + candidate) != sequence) {
+      pos++;
+      continue;
+    }
+
+    int length = min_match;
+    int limit = size - last_literals;
+    while (pos + length < limit && in[candidate + length] == in[pos + length]) length++;
+
+    put_sequence(out, in + anchor, pos - anchor, pos - candidate, length);
+    pos += length;
+    anchor = pos;
+  }
+
+  put_sequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+bool lz_decompress(const uint8_t* in, int size, uint8_t* out, int out_size) {
+  const uint8_t* end = in + size;
+  int written = 0;
+
+  while (in < end) {
+    uint8_t token = *in++;
+
+    int literal_count = token >> 4;
+    if (literal_count == 15) {
+      uint8_t extra;
+      do {
+        if (in >= end) return false;
+        extra = *in++;
+        literal_count += extra;
+      } while (extra == 255);
+    }
+    if (literal_count > end - in || literal_count > out_size - written) return false;
+    std::memcpy(out + written, in, literal_count);
+    in += literal_count;
+    written += literal_count;
+
+    // The last sequence has literals only.
+    if (in == end) break;
+
+    if (end - in < 2) return false;
+    int offset = in[0] | (in[1] << 8);
+    in += 2;
+    if (offset == 0 || offset > written) return false;
+
+    int match_length = (token & 15) + min_match;
+    if ((token & 15) == 15) {
+      uint8_t extra;
+      do {
+        if (in >= end) return false;
+        extra = *in++;
+        match_length += extra;
+      } while (extra == 255);
+    }
+    if (match_length > out_size - written) return false;
+
+    // Byte by byte, since a match may overlap the bytes it produces.
+    for (int i = 0; i < match_length; i++, written++) {
+      out[written] = out[written - offset];
+    }
+  }
+
+  return written == out_size;
+}
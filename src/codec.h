@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Encodings used by the snapshot files.
+
+// IEEE half precision, rounding to nearest even. Values beyond the half
+// range become infinity and NaN stays NaN.
+uint16_t float_to_half(float value);
+float half_to_float(uint16_t half);
+
+// Regroups count elements of `size` bytes so that byte b of every element
+// comes before byte b + 1 of any. Float fields change smoothly, so their
+// high bytes repeat and the shuffled data compresses far better.
+void shuffle_bytes(const uint8_t* in, uint8_t* out, int count, int size);
+void unshuffle_bytes(const uint8_t* in, uint8_t* out, int count, int size);
+
+// Compression in the LZ4 block format: greedy matching through a hash of
+// the next four bytes, no entropy coding, so both directions run at memory
+// speed. lz_compress appends to out; lz_decompress writes exactly out_size
+// bytes and returns false on malformed input instead of overrunning.
+void lz_compress(const uint8_t* in, int size, std::vector<uint8_t>& out);
+bool lz_decompress(const uint8_t* in, int size, uint8_t* out, int out_size);
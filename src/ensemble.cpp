@@ -0,0 +1,114 @@
+#include "ensemble.h"
+#include "trace.h"
+
+#include <algorithm>
+
+Ensemble::Ensemble(int width, int height, int members, int threads) :
+  diff(members, 0.0003f),
+  visc(members, 0.0f),
+  iterations(members, 20),
+  w(width),
+  h(height),
+  n(std::max(width, height)),
+  members(members),
+  kernels(select_kernels(width, height)),
+  redblack(redblack_row(simd_level())),
+  u((size_t)members * array_size(), 0.0f),
+  v((size_t)members * array_size(), 0.0f),
+  up((size_t)members * array_size(), 0.0f),
+  vp((size_t)members * array_size(), 0.0f),
+  dens((size_t)members * array_size(), 0.0f),
+  dens_prev((size_t)members * array_size(), 0.0f),
+  pool(threads) {
+
+  int thread_count = pool.size();
+  for (int t = 0; t < thread_count; t++) {
+    lanes.push_back(std::make_unique<ThreadPool>(1));
+  }
+
+  for (int t = 0; t <= thread_count; t++) {
+    block_begin.push_back((int)((int64_t)members * t / thread_count));
+  }
+  next.reset(new std::atomic<int>[thread_count]);
+}
+
+void Ensemble::clear_sources() {
+  std::fill(up.begin(), up.end(), 0.0f);
+  std::fill(vp.begin(), vp.end(), 0.0f);
+  std::fill(dens_prev.begin(), dens_prev.end(), 0.0f);
+}
+
+void Ensemble::step(float dt) {
+  FLUID_TRACE_SCOPE("ensemble_step", (int64_t)members * w * h);
+  int thread_count = pool.size();
+
+  for (int t = 0; t < thread_count; t++) next[t].store(block_begin[t]);
+  steal_count.store(0);
+
+  // One band per thread, so band t is thread t's own block.
+  pool.parallel_rows(0, thread_count, [&](int band_begin, int band_end) {
+    for (int t = band_begin; t < band_end; t++) {
+      ThreadPool& lane = *lanes[t];
+
+      // Own block first, then the others, starting with the next one along.
+      for (int k = 0; k < thread_count; k++) {
+        int victim = (t + k) % thread_count;
+        while (true) {
+          int m = next[victim].fetch_add(1);
+          if (m >= block_begin[victim + 1]) break;
+          if (k > 0) steal_count.fetch_add(1, std::memory_order_relaxed);
+          step_member(m, dt, lane);
+        }
+      }
+    }
+  });
+
+  last_steals = steal_count.load();
+}
+
+// Solver::velocity_step and density_step for one member, on one thread.
+void Ensemble::step_member(int m, float dt, ThreadPool& lane) {
+  size_t offset = (size_t)m * array_size();
+  float* mu = u.data() + offset;
+  float* mv = v.data() + offset;
+  float* mup = up.data() + offset;
+  float* mvp = vp.data() + offset;
+  float* md = dens.data() + offset;
+  float* mdp = dens_prev.data() + offset;
+  int sweeps = iterations[m];
+
+  kernels.add_source(w, h, 1, h + 1, mu, mup, dt);
+  kernels.add_source(w, h, 1, h + 1, mv, mvp, dt);
+
+  diffuse(lane, mup, mu, visc[m], dt, sweeps);
+  diffuse(lane, mvp, mv, visc[m], dt, sweeps);
+
+  project(lane, mup, mvp, mu, mv, sweeps);
+
+  kernels.advect_velocity(w, h, 1, h + 1, mu, mv, mup, mvp, mup, mvp, dt * n);
+
+  project(lane, mu, mv, mup, mvp, sweeps);
+
+  kernels.add_source(w, h, 1, h + 1, md, mdp, dt);
+  diffuse(lane, mdp, md, diff[m], dt, sweeps);
+  kernels.advect(w, h, 1, h + 1, md, mdp, mu, mv, dt * n);
+}
+
+void Ensemble::diffuse(ThreadPool& lane, float* dest, const float* src, float diff, float dt, int iterations) {
+  float a = dt * diff * n * n;
+  float c = 1.0f / (1 + 4 * a);
+
+  for (int k = 0; k < iterations; k++) {
+    redblack_sweep(lane, redblack, w, h, dest, src, a, c);
+  }
+}
+
+void Ensemble::project(ThreadPool& lane, float* vel_u, float* vel_v, float* p, float* div, int iterations) {
+  float cell = 1.0f / n;
+
+  kernels.divergence(w, h, 1, h + 1, vel_u, vel_v, p, div, cell);
+  for (int k = 0; k < iterations; k++) {
+    redblack_sweep(lane, redblack, w, h, p, div, 1.0f, 0.25f);
+  }
+  kernels.subtract_gradient(w, h, 1, h + 1, vel_u, vel_v, p, cell);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "kernels.h"
+#include "redblack.h"
+#include "thread_pool.h"
+
+// Many small, independent simulations of one grid size advanced together,
+// for parameter sweeps over diff, visc and iterations that would otherwise
+// take one process per grid.
+//
+// Every field is one array holding all members back to back, member m at
+// offset m * array_size(), so a member's fields are contiguous and small
+// grids stay in cache while one thread steps them. Members, not rows, are
+// what gets split between threads: each thread starts on its own block of
+// members and, once that runs out, steals members still waiting in the
+// other blocks, so members that cost more (more iterations) do not leave
+// threads idle. Within a member the kernels are Solver's, vectorised along
+// rows as usual.
+//
+// A member steps exactly like a Solver of the same size and parameters with
+// red-black relaxation, the Sweeps pressure solve and SemiLagrangian
+// advection: the results agree bit for bit, whatever the thread count.
+// Obstacles, sparse tiles, Jacobi, multigrid and the higher order
+// advection schemes are not available here.
+class Ensemble {
+public:
+  Ensemble(int width, int height, int members, int threads = 0);
+
+  // Advances every member by dt.
+  void step(float dt);
+
+  // Zeroes the source arrays of every member; see Solver::clear_sources.
+  void clear_sources();
+
+  int index(int x, int y) const { return x + (w + 2) * y; }
+  int width() const { return w; }
+  int height() const { return h; }
+  int array_size() const { return (w + 2) * (h + 2); }
+  int member_count() const { return members; }
+  int thread_count() const { return pool.size(); }
+
+  float* density(int m) { return dens.data() + (size_t)m * array_size(); }
+  float* velocity_u(int m) { return u.data() + (size_t)m * array_size(); }
+  float* velocity_v(int m) { return v.data() + (size_t)m * array_size(); }
+
+  float* density_source(int m) { return dens_prev.data() + (size_t)m * array_size(); }
+  float* velocity_u_source(int m) { return up.data() + (size_t)m * array_size(); }
+  float* velocity_v_source(int m) { return vp.data() + (size_t)m * array_size(); }
+
+  // Per member parameters, one entry per member, starting at Solver's
+  // defaults.
+  std::vector<float> diff;
+  std::vector<float> visc;
+  std::vector<int> iterations;
+
+  // Members the threads took from each other's blocks during the last step.
+  int steals() const { return last_steals; }
+
+private:
+  void step_member(int m, float dt, ThreadPool& lane);
+  void diffuse(ThreadPool& lane, float* dest, const float* src, float diff, float dt, int iterations);
+  void project(ThreadPool& lane, float* vel_u, float* vel_v, float* p, float* div, int iterations);
+
+  int w, h;
+  int n;
+  int members;
+  const KernelTable& kernels;
+  RedBlackRow redblack;
+  std::vector<float> u, v, up, vp;
+  std::vector<float> dens, dens_prev;
+  ThreadPool pool;
+  // Single threaded pool per thread of pool, so the relaxation runs inline
+  // on whichever thread owns the member.
+  std::vector<std::unique_ptr<ThreadPool>> lanes;
+  // Block t covers members [block_begin[t], block_begin[t + 1]); next[t] is
+  // the first one not yet taken, claimed by owner and thieves alike.
+  std::vector<int> block_begin;
+  std::unique_ptr<std::atomic<int>[]> next;
+  std::atomic<int> steal_count { 0 };
+  int last_steals = 0;
+};
@@ -0,0 +1,48 @@
+#include "kernels.h"
+
+template <int FW, int FH>
+static KernelTable make_table() {
+  KernelTable table = {
+    &add_source_rows<FW, FH>,
+    &relax_rows<FW, FH>,
+    &divergence_rows<FW, FH>,
+    &subtract_gradient_rows<FW, FH>,
+    &advect_rows<FW, FH>,
+    &add_source_row<FW, FH>,
+    &divergence_row<FW, FH>,
+    &advect_velocity_rows<FW, FH>,
+    &divergence_masked_rows<FW, FH>,
+    &subtract_gradient_masked_rows<FW, FH>,
+    &advect_masked_rows<FW, FH>,
+    &add_source_span<FW, FH>,
+    &divergence_span<FW, FH>,
+    &subtract_gradient_span<FW, FH>,
+    &advect_span<FW, FH>,
+    &maccormack_correct_rows<FW, FH>,
+    &bfecc_compensate_rows<FW, FH>,
+    &advect_clamped_rows<FW, FH>,
+  };
+  return table;
+}
+
+const KernelTable& select_kernels(int w, int h) {
+  static const KernelTable runtime = make_table<0, 0>();
+  static const KernelTable square_128 = make_table<128, 128>();
+  static const KernelTable square_200 = make_table<200, 200>();
+  static const KernelTable square_256 = make_table<256, 256>();
+  static const KernelTable square_512 = make_table<512, 512>();
+  static const KernelTable square_1024 = make_table<1024, 1024>();
+  static const KernelTable square_2048 = make_table<2048, 2048>();
+
+  if (w != h) return runtime;
+
+  switch (w) {
+    case 128: return square_128;
+    case 200: return square_200;
+    case 256: return square_256;
+    case 512: return square_512;
+    case 1024: return square_1024;
+    case 2048: return square_2048;
+    default: return runtime;
+  }
+}
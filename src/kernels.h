@@ -0,0 +1,383 @@
+#pragma once
+
+#include <algorithm>
+
+// Row-band kernels behind Solver. Every kernel works on rows
+// [row_begin, row_end) of a (w+2) x (h+2) field with a one cell halo.
+//
+// The kernels are templates on the grid size: FW = FH = 0 reads the size
+// from the w/h arguments, any other value bakes it in at compile time so the
+// row stride and loop bounds are constants. select_kernels() hands out the
+// specialised table when the grid matches one of the common sizes and the
+// runtime one otherwise.
+
+struct KernelTable {
+  // dest += src * dt
+  void (*add_source)(int w, int h, int row_begin, int row_end, float* dest, const float* src, float dt);
+
+  // One Jacobi sweep of x_next = (b + a * (sum of x neighbours)) * c. Used for
+  // both diffuse (c = 1 / (1 + 4a)) and the pressure solve (a = 1, c = 1/4).
+  void (*relax)(int w, int h, int row_begin, int row_end, float* x_next, const float* x, const float* b, float a, float c);
+
+  // project_compute_a: div from the velocity field, p cleared.
+  void (*divergence)(int w, int h, int row_begin, int row_end, const float* vel_u, const float* vel_v, float* p, float* div, float cell);
+
+  // project_compute_c: subtract the pressure gradient from the velocity.
+  void (*subtract_gradient)(int w, int h, int row_begin, int row_end, float* vel_u, float* vel_v, const float* p, float cell);
+
+  // Semi-Lagrangian backtrace with bilinear lookup, dt0 = dt / cell.
+  void (*advect)(int w, int h, int row_begin, int row_end, float* dest, const float* src, const float* vel_u, const float* vel_v, float dt0);
+
+  // Single-row forms of add_source and divergence that write row j of the
+  // result into out[0 .. w+1] instead of a field, for feeding a relaxation
+  // without storing its right hand side first.
+  void (*add_source_row)(int w, int h, int j, float* out, const float* dest, const float* src, float dt);
+  void (*divergence_row)(int w, int h, int j, float* out, const float* vel_u, const float* vel_v, float cell);
+
+  // advect for both velocity components at once: they share the backtrace,
+  // so it is computed once and the velocity is read once.
+  void (*advect_velocity)(int w, int h, int row_begin, int row_end, float* dest_u, float* dest_v, const float* src_u, const float* src_v, const float* vel_u, const float* vel_v, float dt0);
+
+  // divergence, subtract_gradient and advect with obstacles, taking the
+  // ObstacleMap flags of each cell. Solid cells come out zero; the gradient
+  // reflects the cell's own pressure into neighbours that are not open, so
+  // no flow is driven through a wall.
+  void (*divergence_masked)(int w, int h, int row_begin, int row_end, const float* vel_u, const float* vel_v, float* p, float* div, float cell, const unsigned char* flags);
+  void (*subtract_gradient_masked)(int w, int h, int row_begin, int row_end, float* vel_u, float* vel_v, const float* p, float cell, const unsigned char* flags);
+  void (*advect_masked)(int w, int h, int row_begin, int row_end, float* dest, const float* src, const float* vel_u, const float* vel_v, float dt0, const unsigned char* flags);
+
+  // add_source, divergence, subtract_gradient and advect over cells
+  // [col_begin, col_end) of row j only, for skipping inactive tiles.
+  void (*add_source_span)(int w, int h, int j, int col_begin, int col_end, float* dest, const float* src, float dt);
+  void (*divergence_span)(int w, int h, int j, int col_begin, int col_end, const float* vel_u, const float* vel_v, float* p, float* div, float cell);
+  void (*subtract_gradient_span)(int w, int h, int j, int col_begin, int col_end, float* vel_u, float* vel_v, const float* p, float cell);
+  void (*advect_span)(int w, int h, int j, int col_begin, int col_end, float* dest, const float* src, const float* vel_u, const float* vel_v, float dt0);
+
+  // Second pass of MacCormack advection, after forward = advect(src):
+  // backtraces forward along +velocity to estimate the error of the
+  // forward pass, corrects by half of it, and clamps the result to the
+  // four src values the forward pass interpolated between.
+  void (*maccormack_correct)(int w, int h, int row_begin, int row_end, float* dest, const float* forward, const float* src, const float* vel_u, const float* vel_v, float dt0);
+
+  // Second pass of BFECC: out = src + (src - advect back of forward) / 2,
+  // the error compensated field the third pass advects again.
+  void (*bfecc_compensate)(int w, int h, int row_begin, int row_end, float* out, const float* forward, const float* src, const float* vel_u, const float* vel_v, float dt0);
+
+  // advect of src, clamped to the four values of limit that the same
+  // backtrace interpolates between. Third pass of BFECC.
+  void (*advect_clamped)(int w, int h, int row_begin, int row_end, float* dest, const float* src, const float* limit, const float* vel_u, const float* vel_v, float dt0);
+};
+
+// Specialised for 128, 200, 256, 512, 1024 and 2048 square grids.
+const KernelTable& select_kernels(int w, int h);
+
+template <int FW, int FH>
+struct GridShape {
+  static int width(int w) { return FW > 0 ? FW : w; }
+  static int height(int h) { return FH > 0 ? FH : h; }
+  static int stride(int w) { return width(w) + 2; }
+};
+
+// Bilinear lookup at a backtraced position, clamped to half a cell inside
+// the grid: the source cell (i0, j0) to (i0 + 1, j0 + 1) and the weights
+// across it. Every advect kernel backtraces through this.
+struct Bilinear {
+  int i0, j0;
+  float s0, s1, t0, t1;
+
+  Bilinear(float x, float y, int width, int height) {
+    if (x < 0.5f) x = 0.5f;
+    if (x > width + 0.5f) x = width + 0.5f;
+    i0 = (int)x;
+    if (y < 0.5f) y = 0.5f;
+    if (y > height + 0.5f) y = height + 0.5f;
+    j0 = (int)y;
+    s1 = x - i0;
+    s0 = 1 - s1;
+    t1 = y - j0;
+    t0 = 1 - t1;
+  }
+
+  float sample(const float* f, int stride) const {
+    int k = i0 + stride * j0;
+    return s0 * (t0 * f[k] + t1 * f[k + stride]) + s1 * (t0 * f[k + 1] + t1 * f[k + 1 + stride]);
+  }
+
+  float clamp(float value, const float* f, int stride) const {
+    int k = i0 + stride * j0;
+    float lo = std::min(std::min(f[k], f[k + stride]), std::min(f[k + 1], f[k + 1 + stride]));
+    float hi = std::max(std::max(f[k], f[k + stride]), std::max(f[k + 1], f[k + 1 + stride]));
+    return std::min(std::max(value, lo), hi);
+  }
+};
+
+template <int FW, int FH>
+void add_source_rows(int w, int h, int row_begin, int row_end, float* dest, const float* src, float dt) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      dest[i + stride * j] += src[i + stride * j] * dt;
+    }
+  }
+}
+
+template <int FW, int FH>
+void relax_rows(int w, int h, int row_begin, int row_end, float* x_next, const float* x, const float* b, float a, float c) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      x_next[k] = (b[k] + a * (x[k + stride] + x[k - stride] + x[k + 1] + x[k - 1])) * c;
+    }
+  }
+}
+
+template <int FW, int FH>
+void divergence_rows(int w, int h, int row_begin, int row_end, const float* vel_u, const float* vel_v, float* p, float* div, float cell) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      div[k] = -0.5f * cell * (vel_u[k + 1] - vel_u[k - 1] + vel_v[k + stride] - vel_v[k - stride]);
+      p[k] = 0;
+    }
+  }
+}
+
+template <int FW, int FH>
+void subtract_gradient_rows(int w, int h, int row_begin, int row_end, float* vel_u, float* vel_v, const float* p, float cell) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      vel_u[k] -= 0.5f * (p[k + 1] - p[k - 1]) / cell;
+      vel_v[k] -= 0.5f * (p[k + stride] - p[k - stride]) / cell;
+    }
+  }
+}
+
+template <int FW, int FH>
+void advect_rows(int w, int h, int row_begin, int row_end, float* dest, const float* src, const float* vel_u, const float* vel_v, float dt0) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int height = G::height(h);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      Bilinear back(i - dt0 * vel_u[k], j - dt0 * vel_v[k], width, height);
+      dest[k] = back.sample(src, stride);
+    }
+  }
+}
+
+template <int FW, int FH>
+void add_source_row(int w, int h, int j, float* out, const float* dest, const float* src, float dt) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int stride = G::stride(w);
+
+  out[0] = out[width + 1] = 0;
+  for (int i = 1; i <= width; i++) {
+    out[i] = dest[i + stride * j] + src[i + stride * j] * dt;
+  }
+}
+
+template <int FW, int FH>
+void divergence_row(int w, int h, int j, float* out, const float* vel_u, const float* vel_v, float cell) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int stride = G::stride(w);
+
+  out[0] = out[width + 1] = 0;
+  for (int i = 1; i <= width; i++) {
+    int k = i + stride * j;
+    out[i] = -0.5f * cell * (vel_u[k + 1] - vel_u[k - 1] + vel_v[k + stride] - vel_v[k - stride]);
+  }
+}
+
+template <int FW, int FH>
+void advect_velocity_rows(int w, int h, int row_begin, int row_end, float* dest_u, float* dest_v, const float* src_u, const float* src_v, const float* vel_u, const float* vel_v, float dt0) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int height = G::height(h);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      Bilinear back(i - dt0 * vel_u[k], j - dt0 * vel_v[k], width, height);
+      dest_u[k] = back.sample(src_u, stride);
+      dest_v[k] = back.sample(src_v, stride);
+    }
+  }
+}
+
+template <int FW, int FH>
+void divergence_masked_rows(int w, int h, int row_begin, int row_end, const float* vel_u, const float* vel_v, float* p, float* div, float cell, const unsigned char* flags) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      float fluid = (float)(flags[k] & 1);
+      div[k] = fluid * (-0.5f * cell * (vel_u[k + 1] - vel_u[k - 1] + vel_v[k + stride] - vel_v[k - stride]));
+      p[k] = 0;
+    }
+  }
+}
+
+template <int FW, int FH>
+void subtract_gradient_masked_rows(int w, int h, int row_begin, int row_end, float* vel_u, float* vel_v, const float* p, float cell, const unsigned char* flags) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      int f = flags[k];
+      float fluid = (float)(f & 1);
+      float left = (float)((f >> 1) & 1);
+      float right = (float)((f >> 2) & 1);
+      float down = (float)((f >> 3) & 1);
+      float up = (float)((f >> 4) & 1);
+      float p_left = left * p[k - 1] + (1 - left) * p[k];
+      float p_right = right * p[k + 1] + (1 - right) * p[k];
+      float p_down = down * p[k - stride] + (1 - down) * p[k];
+      float p_up = up * p[k + stride] + (1 - up) * p[k];
+      vel_u[k] -= fluid * (0.5f * (p_right - p_left) / cell);
+      vel_v[k] -= fluid * (0.5f * (p_up - p_down) / cell);
+    }
+  }
+}
+
+template <int FW, int FH>
+void advect_masked_rows(int w, int h, int row_begin, int row_end, float* dest, const float* src, const float* vel_u, const float* vel_v, float dt0, const unsigned char* flags) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int height = G::height(h);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      float fluid = (float)(flags[k] & 1);
+      Bilinear back(i - dt0 * vel_u[k], j - dt0 * vel_v[k], width, height);
+      dest[k] = fluid * back.sample(src, stride);
+    }
+  }
+}
+
+template <int FW, int FH>
+void add_source_span(int w, int h, int j, int col_begin, int col_end, float* dest, const float* src, float dt) {
+  typedef GridShape<FW, FH> G;
+  const int stride = G::stride(w);
+
+  for (int i = col_begin; i < col_end; i++) {
+    dest[i + stride * j] += src[i + stride * j] * dt;
+  }
+}
+
+template <int FW, int FH>
+void divergence_span(int w, int h, int j, int col_begin, int col_end, const float* vel_u, const float* vel_v, float* p, float* div, float cell) {
+  typedef GridShape<FW, FH> G;
+  const int stride = G::stride(w);
+
+  for (int i = col_begin; i < col_end; i++) {
+    int k = i + stride * j;
+    div[k] = -0.5f * cell * (vel_u[k + 1] - vel_u[k - 1] + vel_v[k + stride] - vel_v[k - stride]);
+    p[k] = 0;
+  }
+}
+
+template <int FW, int FH>
+void subtract_gradient_span(int w, int h, int j, int col_begin, int col_end, float* vel_u, float* vel_v, const float* p, float cell) {
+  typedef GridShape<FW, FH> G;
+  const int stride = G::stride(w);
+
+  for (int i = col_begin; i < col_end; i++) {
+    int k = i + stride * j;
+    vel_u[k] -= 0.5f * (p[k + 1] - p[k - 1]) / cell;
+    vel_v[k] -= 0.5f * (p[k + stride] - p[k - stride]) / cell;
+  }
+}
+
+template <int FW, int FH>
+void advect_span(int w, int h, int j, int col_begin, int col_end, float* dest, const float* src, const float* vel_u, const float* vel_v, float dt0) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int height = G::height(h);
+  const int stride = G::stride(w);
+
+  for (int i = col_begin; i < col_end; i++) {
+    int k = i + stride * j;
+    Bilinear back(i - dt0 * vel_u[k], j - dt0 * vel_v[k], width, height);
+    dest[k] = back.sample(src, stride);
+  }
+}
+
+template <int FW, int FH>
+void maccormack_correct_rows(int w, int h, int row_begin, int row_end, float* dest, const float* forward, const float* src, const float* vel_u, const float* vel_v, float dt0) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int height = G::height(h);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      Bilinear back(i - dt0 * vel_u[k], j - dt0 * vel_v[k], width, height);
+      Bilinear ahead(i + dt0 * vel_u[k], j + dt0 * vel_v[k], width, height);
+      float value = forward[k] + 0.5f * (src[k] - ahead.sample(forward, stride));
+      dest[k] = back.clamp(value, src, stride);
+    }
+  }
+}
+
+template <int FW, int FH>
+void bfecc_compensate_rows(int w, int h, int row_begin, int row_end, float* out, const float* forward, const float* src, const float* vel_u, const float* vel_v, float dt0) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int height = G::height(h);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      Bilinear ahead(i + dt0 * vel_u[k], j + dt0 * vel_v[k], width, height);
+      out[k] = src[k] + 0.5f * (src[k] - ahead.sample(forward, stride));
+    }
+  }
+}
+
+template <int FW, int FH>
+void advect_clamped_rows(int w, int h, int row_begin, int row_end, float* dest, const float* src, const float* limit, const float* vel_u, const float* vel_v, float dt0) {
+  typedef GridShape<FW, FH> G;
+  const int width = G::width(w);
+  const int height = G::height(h);
+  const int stride = G::stride(w);
+
+  for (int j = row_begin; j < row_end; j++) {
+    for (int i = 1; i <= width; i++) {
+      int k = i + stride * j;
+      Bilinear back(i - dt0 * vel_u[k], j - dt0 * vel_v[k], width, height);
+      dest[k] = back.clamp(back.sample(src, stride), limit, stride);
+    }
+  }
+}
@@ -0,0 +1,213 @@
+#include "multigrid.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+MultigridPoisson::MultigridPoisson(int w, int h, ThreadPool& pool) :
+  w(w),
+  h(h),
+  pool(pool),
+  smooth_row(redblack_row(simd_level())),
+  r((w + 2) * (h + 2), 0.0f),
+  z((w + 2) * (h + 2), 0.0f),
+  d((w + 2) * (h + 2), 0.0f),
+  q((w + 2) * (h + 2), 0.0f),
+  row_sums(h + 2, 0.0) {
+
+  // Level 0 works on the caller's arrays, so it needs no storage.
+  levels.push_back(Level { w, h });
+
+  while (std::min(levels.back().w, levels.back().h) > 4) {
+    const Level& fine = levels.back();
+    Level coarse = { (fine.w + 1) / 2, (fine.h + 1) / 2 };
+    coarse.x.assign((coarse.w + 2) * (coarse.h + 2), 0.0f);
+    coarse.b.assign((coarse.w + 2) * (coarse.h + 2), 0.0f);
+    levels.push_back(std::move(coarse));
+  }
+}
+
+double MultigridPoisson::dot(const float* a, const float* b) {
+  int stride = w + 2;
+
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    for (int j = row_begin; j < row_end; j++) {
+      double sum = 0.0;
+      for (int i = 1; i <= w; i++) {
+        sum += (double)a[i + stride * j] * b[i + stride * j];
+      }
+      row_sums[j] = sum;
+    }
+  });
+
+  double total = 0.0;
+  for (int j = 1; j <= h; j++) total += row_sums[j];
+  return total;
+}
+
+// Restriction is the transpose of prolong: each coarse cell gathers the
+// residual of the 4x4 block of fine cells around it with weights
+// (1 3 3 1) x (1 3 3 1) / 16.
+void MultigridPoisson::restrict_residual(const Level& fine, const float* x, const float* b, Level& coarse) {
+  int stride = fine.w + 2;
+  int coarse_stride = coarse.w + 2;
+  static const float weights[4] = { 0.25f, 0.75f, 0.75f, 0.25f };
+
+  pool.parallel_rows(1, coarse.h + 1, [&](int row_begin, int row_end) {
+    for (int cj = row_begin; cj < row_end; cj++) {
+      for (int ci = 1; ci <= coarse.w; ci++) {
+        float sum = 0.0f;
+        for (int dj = 0; dj < 4; dj++) {
+          int j = 2 * cj - 2 + dj;
+          if (j < 1 || j > fine.h) continue;
+          for (int di = 0; di < 4; di++) {
+            int i = 2 * ci - 2 + di;
+            if (i < 1 || i > fine.w) continue;
+            int k = i + stride * j;
+            float residual = b[k] - (4 * x[k] - x[k - 1] - x[k + 1] - x[k - stride] - x[k + stride]);
+            sum += weights[di] * weights[dj] * residual;
+          }
+        }
+        coarse.b[ci + coarse_stride * cj] = sum;
+      }
+    }
+  });
+}
+
+// Bilinear interpolation between cell centres: a fine cell takes 9/16 of its
+// parent, 3/16 of each of the two nearest coarse neighbours and 1/16 of the
+// diagonal one. Coarse halo cells are zero, matching the fine boundary.
+void MultigridPoisson::prolong(const Level& coarse, const Level& fine, float* x) {
+  int stride = fine.w + 2;
+  int coarse_stride = coarse.w + 2;
+
+  pool.parallel_rows(1, fine.h + 1, [&](int row_begin, int row_end) {
+    for (int j = row_begin; j < row_end; j++) {
+      int cj = (j + 1) / 2;
+      int cj_near = (j & 1) ? cj - 1 : cj + 1;
+      const float* row = coarse.x.data() + coarse_stride * cj;
+      const float* row_near = coarse.x.data() + coarse_stride * cj_near;
+      for (int i = 1; i <= fine.w; i++) {
+        int ci = (i + 1) / 2;
+        int ci_near = (i & 1) ? ci - 1 : ci + 1;
+        x[i + stride * j] += 0.5625f * row[ci] + 0.1875f * (row[ci_near] + row_near[ci]) + 0.0625f * row_near[ci_near];
+      }
+    }
+  });
+}
+
+void MultigridPoisson::vcycle(int l, float* x, const float* b) {
+  const Level& level = levels[l];
+  std::fill(x, x + (level.w + 2) * (level.h + 2), 0.0f);
+
+  if (l + 1 == (int)levels.size()) {
+    for (int k = 0; k < coarse_sweeps; k++) {
+      redblack_sweep(pool, smooth_row, level.w, level.h, x, b, 1.0f, 0.25f, 0);
+    }
+    for (int k = 0; k < coarse_sweeps; k++) {
+      redblack_sweep(pool, smooth_row, level.w, level.h, x, b, 1.0f, 0.25f, 1);
+    }
+    return;
+  }
+
+  for (int k = 0; k < pre_smooth; k++) {
+    redblack_sweep(pool, smooth_row, level.w, level.h, x, b, 1.0f, 0.25f, 0);
+  }
+
+  Level& coarse = levels[l + 1];
+  restrict_residual(level, x, b, coarse);
+  vcycle(l + 1, coarse.x.data(), coarse.b.data());
+  prolong(coarse, level, x);
+
+  for (int k = 0; k < post_smooth; k++) {
+    redblack_sweep(pool, smooth_row, level.w, level.h, x, b, 1.0f, 0.25f, 1);
+  }
+}
+
+int MultigridPoisson::solve(float* p, const float* div, float tolerance, int max_iterations) {
+  int stride = w + 2;
+
+  double b_norm = std::sqrt(dot(div, div));
+  if (b_norm == 0.0) {
+    std::fill(p, p + (w + 2) * (h + 2), 0.0f);
+    last_residual = 0.0f;
+    return 0;
+  }
+
+  // r = div - A p
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    for (int j = row_begin; j < row_end; j++) {
+      for (int i = 1; i <= w; i++) {
+        int k = i + stride * j;
+        r[k] = div[k] - (4 * p[k] - p[k - 1] - p[k + 1] - p[k - stride] - p[k + stride]);
+      }
+    }
+  });
+
+  double r_norm = std::sqrt(dot(r.data(), r.data()));
+  int iteration = 0;
+
+  if (r_norm > tolerance * b_norm) {
+    vcycle(0, z.data(), r.data());
+    d = z;
+    double rz = dot(r.data(), z.data());
+
+    while (iteration < max_iterations) {
+      iteration++;
+
+      // q = A d, with d.q summed per row alongside.
+      pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+        for (int j = row_begin; j < row_end; j++) {
+          double sum = 0.0;
+          for (int i = 1; i <= w; i++) {
+            int k = i + stride * j;
+            q[k] = 4 * d[k] - d[k - 1] - d[k + 1] - d[k - stride] - d[k + stride];
+            sum += (double)d[k] * q[k];
+          }
+          row_sums[j] = sum;
+        }
+      });
+
+      double dq = 0.0;
+      for (int j = 1; j <= h; j++) dq += row_sums[j];
+      if (dq <= 0.0) break;
+      float alpha = (float)(rz / dq);
+
+      // p += alpha d, r -= alpha q, with r.r summed per row alongside.
+      pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+        for (int j = row_begin; j < row_end; j++) {
+          double sum = 0.0;
+          for (int i = 1; i <= w; i++) {
+            int k = i + stride * j;
+            p[k] += alpha * d[k];
+            r[k] -= alpha * q[k];
+            sum += (double)r[k] * r[k];
+          }
+          row_sums[j] = sum;
+        }
+      });
+
+      double rr = 0.0;
+      for (int j = 1; j <= h; j++) rr += row_sums[j];
+      r_norm = std::sqrt(rr);
+      if (r_norm <= tolerance * b_norm) break;
+
+      vcycle(0, z.data(), r.data());
+      double rz_next = dot(r.data(), z.data());
+      float beta = (float)(rz_next / rz);
+      rz = rz_next;
+
+      pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+        for (int j = row_begin; j < row_end; j++) {
+          for (int i = 1; i <= w; i++) {
+            int k = i + stride * j;
+            d[k] = z[k] + beta * d[k];
+          }
+        }
+      });
+    }
+  }
+
+  last_residual = (float)(r_norm / b_norm);
+  return iteration;
+}
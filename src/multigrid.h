@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+
+#include "redblack.h"
+
+class ThreadPool;
+
+// Solves the pressure Poisson equation of project_compute_b,
+//
+//   4 p(i,j) - p(i-1,j) - p(i+1,j) - p(i,j-1) - p(i,j+1) = div(i,j)
+//
+// on a (w+2) x (h+2) field with a zero halo, using conjugate gradients
+// preconditioned by one geometric multigrid V-cycle per iteration.
+//
+// The V-cycle coarsens by 2 in each direction down to a grid a few cells
+// wide, prolonging bilinearly between cell centres and restricting with the
+// transpose, and uses the same 5-point operator on every level. Smoothing is
+// red-black Gauss-Seidel, red then black on the way down and black then red
+// on the way up, so the preconditioner is symmetric and CG stays valid even
+// where odd grid sizes make coarsening inexact. Each colour updates
+// independent cells, so sweeps split into row bands without changing the
+// result, and reductions are summed per row in a fixed order, so the output
+// does not depend on the thread count.
+class MultigridPoisson {
+public:
+  MultigridPoisson(int w, int h, ThreadPool& pool);
+
+  // Improves p in place until |div - A p| <= tolerance * |div| or
+  // max_iterations CG iterations have run. Returns the iterations used; the
+  // final relative residual is available from residual().
+  int solve(float* p, const float* div, float tolerance, int max_iterations);
+
+  float residual() const { return last_residual; }
+  int level_count() const { return (int)levels.size(); }
+
+  int pre_smooth = 2;
+  int post_smooth = 2;
+  int coarse_sweeps = 16;
+
+private:
+  struct Level {
+    int w, h;
+    std::vector<float> x, b;
+  };
+
+  void vcycle(int level, float* x, const float* b);
+  void restrict_residual(const Level& fine, const float* x, const float* b, Level& coarse);
+  void prolong(const Level& coarse, const Level& fine, float* x);
+
+  double dot(const float* a, const float* b);
+
+  int w, h;
+  ThreadPool& pool;
+  RedBlackRow smooth_row;
+  std::vector<Level> levels;
+  std::vector<float> r, z, d, q;
+  std::vector<double> row_sums;
+  float last_residual = 0.0f;
+};
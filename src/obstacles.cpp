@@ -0,0 +1,48 @@
+#include "obstacles.h"
+
+#include <algorithm>
+
+ObstacleMap::ObstacleMap(int w, int h) :
+  w(w),
+  h(h),
+  solid((w + 2) * (h + 2), 0) {
+
+}
+
+void ObstacleMap::load_rgba(const unsigned char* pixels, int image_width, int image_height) {
+  for (int j = 0; j < h + 2; j++) {
+    int y = std::min(image_height - 1, (int)((j + 0.5) * image_height / (h + 2)));
+    for (int i = 0; i < w + 2; i++) {
+      int x = std::min(image_width - 1, (int)((i + 0.5) * image_width / (w + 2)));
+      solid[i + (w + 2) * j] = pixels[4 * (x + image_width * y) + 3] != 0;
+    }
+  }
+}
+
+void ObstacleMap::set_solid(int i, int j, bool is_solid) {
+  if (i < 0 || i > w + 1 || j < 0 || j > h + 1) return;
+  solid[i + (w + 2) * j] = is_solid;
+}
+
+bool ObstacleMap::empty() const {
+  return std::find(solid.begin(), solid.end(), 1) == solid.end();
+}
+
+std::vector<unsigned char> ObstacleMap::flags() const {
+  int stride = w + 2;
+  std::vector<unsigned char> result(solid.size(), 0);
+
+  for (int j = 1; j <= h; j++) {
+    for (int i = 1; i <= w; i++) {
+      int k = i + stride * j;
+      if (solid[k]) continue;
+      result[k] = Fluid;
+      if (!solid[k - 1]) result[k] |= OpenLeft;
+      if (!solid[k + 1]) result[k] |= OpenRight;
+      if (!solid[k - stride]) result[k] |= OpenDown;
+      if (!solid[k + stride]) result[k] |= OpenUp;
+    }
+  }
+
+  return result;
+}
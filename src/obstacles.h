@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+
+// Solid cells of a (w+2) x (h+2) field, halo included. Solid interior cells
+// are obstacles; solid halo cells are walls. Halo cells that are not solid
+// keep the solver's default open boundary, where fields are held at zero.
+//
+// Kernels do not look at the solid cells themselves but at the per-cell
+// flags built from them by flags(): one byte per cell saying whether the
+// cell is fluid and which of its four neighbours are open, so a kernel turns
+// them into 0/1 weights without branching.
+class ObstacleMap {
+public:
+  enum Flag : unsigned char {
+    Fluid = 1,
+    OpenLeft = 2,   // i - 1
+    OpenRight = 4,  // i + 1
+    OpenDown = 8,   // j - 1
+    OpenUp = 16,    // j + 1
+    OpenAll = OpenLeft | OpenRight | OpenDown | OpenUp,
+  };
+
+  ObstacleMap(int w, int h);
+
+  // Cells whose pixel has nonzero alpha become solid. The RGBA8 image is
+  // stretched over the whole field including the halo and sampled at cell
+  // centres, so map.png's one pixel border lands on the halo ring.
+  void load_rgba(const unsigned char* pixels, int image_width, int image_height);
+
+  void set_solid(int i, int j, bool solid = true);
+  bool is_solid(int i, int j) const { return solid[i + (w + 2) * j] != 0; }
+
+  // True when no cell is solid, in which case the flags describe the
+  // default open boundary and the solver can ignore them.
+  bool empty() const;
+
+  int width() const { return w; }
+  int height() const { return h; }
+
+  // One Flag byte per cell. Halo cells are never fluid.
+  std::vector<unsigned char> flags() const;
+
+private:
+  int w, h;
+  std::vector<unsigned char> solid;
+};
@@ -0,0 +1,301 @@
+#include "redblack.h"
+#include "active_tiles.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define FLUID_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FLUID_TARGET(isa) __attribute__((target(isa)))
+#else
+#define FLUID_TARGET(isa)
+#endif
+
+// The AVX-512 target implies FMA, and the compiler would otherwise fuse the
+// multiply and add of b + a * sum there (and, with -march flags, in the other
+// paths too), rounding once where the others round twice.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// The neighbour sum is added in the same order as relax_rows in kernels.h.
+static void row_scalar(int w, float* x, const float* above, const float* below, const float* b, float a, float c, int parity) {
+  for (int i = 1 + ((1 + parity) & 1); i <= w; i += 2) {
+    x[i] = (b[i] + a * (below[i] + above[i] + x[i + 1] + x[i - 1])) * c;
+  }
+}
+
+#if FLUID_X86
+
+// Every vector covers eight consecutive cells. A row is computed in full into
+// a scratch row first and only then written back, storing just the lanes of
+// the requested colour; storing as we go would make the next vector's unaligned
+// neighbour loads overlap a masked store that cannot be forwarded, which
+// stalls every iteration. The last vector of a row is loaded through a mask
+// so it never touches memory past the row's halo cell.
+static thread_local std::vector<float> scratch_row;
+
+FLUID_TARGET("avx2")
+static void row_avx2(int w, float* x, const float* above, const float* below, const float* b, float a, float c, int parity) {
+  __m256 va = _mm256_set1_ps(a);
+  __m256 vc = _mm256_set1_ps(c);
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i even_lanes = _mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0);
+  __m256i odd_lanes = _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+
+  if ((int)scratch_row.size() < w + 8) scratch_row.resize(w + 8);
+  float* row = scratch_row.data();
+
+  // Lane l holds i = 1 + 8t + l, which is updated when 1 + l + parity is even.
+  __m256i colour_lanes = (parity & 1) ? even_lanes : odd_lanes;
+  int i = 1;
+
+  for (; i + 7 <= w; i += 8) {
+    __m256 sum = _mm256_add_ps(_mm256_loadu_ps(below + i), _mm256_loadu_ps(above + i));
+    sum = _mm256_add_ps(sum, _mm256_loadu_ps(x + i + 1));
+    sum = _mm256_add_ps(sum, _mm256_loadu_ps(x + i - 1));
+    _mm256_storeu_ps(row + i, _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(b + i), _mm256_mul_ps(va, sum)), vc));
+  }
+
+  __m256i tail = _mm256_cmpgt_epi32(_mm256_set1_epi32(w - i + 1), lanes);
+  if (i <= w) {
+    __m256 sum = _mm256_add_ps(_mm256_maskload_ps(below + i, tail), _mm256_maskload_ps(above + i, tail));
+    sum = _mm256_add_ps(sum, _mm256_maskload_ps(x + i + 1, tail));
+    sum = _mm256_add_ps(sum, _mm256_maskload_ps(x + i - 1, tail));
+    _mm256_storeu_ps(row + i, _mm256_mul_ps(_mm256_add_ps(_mm256_maskload_ps(b + i, tail), _mm256_mul_ps(va, sum)), vc));
+  }
+
+  int tail_start = i;
+  for (i = 1; i < tail_start; i += 8) {
+    _mm256_maskstore_ps(x + i, colour_lanes, _mm256_loadu_ps(row + i));
+  }
+  if (i <= w) {
+    _mm256_maskstore_ps(x + i, _mm256_and_si256(colour_lanes, tail), _mm256_loadu_ps(row + i));
+  }
+}
+
+FLUID_TARGET("avx512f")
+static void row_avx512(int w, float* x, const float* above, const float* below, const float* b, float a, float c, int parity) {
+  __m512 va = _mm512_set1_ps(a);
+  __m512 vc = _mm512_set1_ps(c);
+
+  if ((int)scratch_row.size() < w + 16) scratch_row.resize(w + 16);
+  float* row = scratch_row.data();
+
+  __mmask16 colour_lanes = (parity & 1) ? (__mmask16)0x5555 : (__mmask16)0xAAAA;
+  int i = 1;
+
+  for (; i + 15 <= w; i += 16) {
+    __m512 sum = _mm512_add_ps(_mm512_loadu_ps(below + i), _mm512_loadu_ps(above + i));
+    sum = _mm512_add_ps(sum, _mm512_loadu_ps(x + i + 1));
+    sum = _mm512_add_ps(sum, _mm512_loadu_ps(x + i - 1));
+    _mm512_storeu_ps(row + i, _mm512_mul_ps(_mm512_add_ps(_mm512_loadu_ps(b + i), _mm512_mul_ps(va, sum)), vc));
+  }
+
+  __mmask16 tail = (__mmask16)((1u << (w - i + 1)) - 1);
+  if (i <= w) {
+    __m512 sum = _mm512_add_ps(_mm512_maskz_loadu_ps(tail, below + i), _mm512_maskz_loadu_ps(tail, above + i));
+    sum = _mm512_add_ps(sum, _mm512_maskz_loadu_ps(tail, x + i + 1));
+    sum = _mm512_add_ps(sum, _mm512_maskz_loadu_ps(tail, x + i - 1));
+    _mm512_storeu_ps(row + i, _mm512_mul_ps(_mm512_add_ps(_mm512_maskz_loadu_ps(tail, b + i), _mm512_mul_ps(va, sum)), vc));
+  }
+
+  int tail_start = i;
+  for (i = 1; i < tail_start; i += 16) {
+    _mm512_mask_storeu_ps(x + i, colour_lanes, _mm512_loadu_ps(row + i));
+  }
+  if (i <= w) {
+    _mm512_mask_storeu_ps(x + i, (__mmask16)(colour_lanes & tail), _mm512_loadu_ps(row + i));
+  }
+}
+
+static SimdLevel detect_simd_level() {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return SimdAvx512;
+  if (__builtin_cpu_supports("avx2")) return SimdAvx2;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+  bool os_saves_zmm = os_saves_ymm && (_xgetbv(0) & 0xE6) == 0xE6;
+  __cpuidex(info, 7, 0);
+  if (os_saves_zmm && (info[1] & (1 << 16))) return SimdAvx512;
+  if (os_saves_ymm && (info[1] & (1 << 5))) return SimdAvx2;
+#endif
+  return SimdScalar;
+}
+
+#else
+
+static SimdLevel detect_simd_level() {
+  return SimdScalar;
+}
+
+#endif
+
+SimdLevel simd_level() {
+  static const SimdLevel level = [] {
+    SimdLevel detected = detect_simd_level();
+    const char* forced = std::getenv("FLUID_SIMD");
+    if (forced && std::strcmp(forced, "scalar") == 0) return SimdScalar;
+    if (forced && std::strcmp(forced, "avx2") == 0 && detected >= SimdAvx2) return SimdAvx2;
+    return detected;
+  }();
+  return level;
+}
+
+const char* simd_level_name(SimdLevel level) {
+  switch (level) {
+    case SimdAvx512: return "avx512";
+    case SimdAvx2: return "avx2";
+    default: return "scalar";
+  }
+}
+
+RedBlackRow redblack_row(SimdLevel level) {
+#if FLUID_X86
+  if (level == SimdAvx512) return &row_avx512;
+  if (level == SimdAvx2) return &row_avx2;
+#endif
+  return &row_scalar;
+}
+
+// Runs update(j, colour) over rows 1 .. h for one sweep.
+template <typename Update>
+static void sweep_rows(ThreadPool& pool, int h, int first_colour, const Update& update) {
+  int second_colour = 1 - first_colour;
+
+  // Second colour on row j - 1 once the first colour of rows j - 2 .. j is
+  // done, leaving the band's first and last rows for the next pass.
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    for (int j = row_begin; j < row_end; j++) {
+      update(j, first_colour);
+      if (j - 1 > row_begin) update(j - 1, second_colour);
+    }
+  });
+
+  // parallel_rows splits the same range into the same bands both times.
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    update(row_begin, second_colour);
+    if (row_end - 1 > row_begin) update(row_end - 1, second_colour);
+  });
+}
+
+void redblack_sweep(ThreadPool& pool, RedBlackRow row, int w, int h, float* x, const float* b, float a, float c, int first_colour) {
+  int stride = w + 2;
+
+  sweep_rows(pool, h, first_colour, [&](int j, int colour) {
+    float* xj = x + stride * j;
+    row(w, xj, xj - stride, xj + stride, b + stride * j, a, c, (j + colour) & 1);
+  });
+}
+
+void redblack_sweep_spans(ThreadPool& pool, RedBlackRow row, int w, const RowSpan* spans, int span_count, float* x, const float* b, float a, float c, int first_colour) {
+  int stride = w + 2;
+
+  // The row kernel sees the span as a row of its own, starting one cell
+  // before col_begin, so the parity shifts with col_begin.
+  for (int colour = first_colour, pass = 0; pass < 2; colour = 1 - colour, pass++) {
+    pool.parallel_rows(0, span_count, [&](int span_begin, int span_end) {
+      for (int s = span_begin; s < span_end; s++) {
+        const RowSpan& span = spans[s];
+        int offset = stride * span.j + span.col_begin - 1;
+        float* xj = x + offset;
+        row(span.col_end - span.col_begin, xj, xj - stride, xj + stride, b + offset, a, c, (span.j + colour + span.col_begin - 1) & 1);
+      }
+    });
+  }
+}
+
+// Plain scalar loop: the weights come from the flag bits, so it has no
+// branches, but obstacles are not the common case and it has no SIMD version.
+void redblack_sweep_masked(ThreadPool& pool, int w, int h, float* x, const float* b, const unsigned char* flags,
+                           unsigned char forced_open, float a, const float* c_by_open, int first_colour) {
+  int stride = w + 2;
+
+  sweep_rows(pool, h, first_colour, [&](int j, int colour) {
+    for (int i = 1 + ((1 + j + colour) & 1); i <= w; i += 2) {
+      int k = i + stride * j;
+      int f = flags[k] | forced_open;
+      float fluid = (float)(f & 1);
+      float left = (float)((f >> 1) & 1);
+      float right = (float)((f >> 2) & 1);
+      float down = (float)((f >> 3) & 1);
+      float up = (float)((f >> 4) & 1);
+      float sum = up * x[k + stride] + down * x[k - stride] + right * x[k + 1] + left * x[k - 1];
+      x[k] = fluid * (b[k] + a * sum) * c_by_open[(f >> 1) & 15];
+    }
+  });
+}
+
+// Rolling windows for redblack_blocked, one set per band thread.
+static thread_local std::vector<float> block_x;
+static thread_local std::vector<float> block_b;
+static thread_local std::vector<const float*> block_b_rows;
+
+void redblack_blocked(ThreadPool& pool, RedBlackRow row, int w, int h, int sweeps, const float* x_in, float* x_out,
+                      const float* b, float a, float c, const BlockRowSource& b_source) {
+  int stride = w + 2;
+  int ghost = 2 * sweeps;
+  // Row j is last read by the final black update of row j + 1, in step
+  // j + 2 * sweeps, so its slot can be reused by the row loaded in the next.
+  // Rounded up to a power of two so a row's slot is a mask away.
+  int window = 1;
+  while (window < 2 * sweeps + 2) window *= 2;
+
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    int first = std::max(1, row_begin - ghost);
+    int last = std::min(h, row_end - 1 + ghost);
+
+    block_x.resize(window * stride);
+    block_b.resize(window * stride);
+    block_b_rows.resize(window);
+
+    auto slot = [&](int j) { return j & (window - 1); };
+    auto x_row = [&](int j) { return block_x.data() + stride * slot(j); };
+
+    auto load = [&](int j) {
+      float* xj = x_row(j);
+      if (x_in) std::memcpy(xj, x_in + stride * j, stride * sizeof(float));
+      else std::fill(xj, xj + stride, 0.0f);
+      if (j < first || j > last) return;
+      if (b_source) block_b_rows[slot(j)] = b_source(j, block_b.data() + stride * slot(j), j >= row_begin && j < row_end);
+      else block_b_rows[slot(j)] = b + stride * j;
+    };
+
+    auto update = [&](int j, int colour) {
+      row(w, x_row(j), x_row(j - 1), x_row(j + 1), block_b_rows[slot(j)], a, c, (j + colour) & 1);
+    };
+
+    // In step j sweep t does red on row j - 2t and black on the row above it,
+    // which by then has its red neighbours of sweep t on both sides.
+    load(first - 1);
+    load(first);
+    for (int j = first; j < last + ghost; j++) {
+      if (j <= last) load(j + 1);
+      for (int t = 0; t < sweeps; t++) {
+        int red = j - 2 * t;
+        if (red >= first && red <= last) update(red, 0);
+        int black = red - 1;
+        if (black < first || black > last) continue;
+        update(black, 1);
+        if (t + 1 == sweeps && black >= row_begin && black < row_end) {
+          std::memcpy(x_out + stride * black, x_row(black), stride * sizeof(float));
+        }
+      }
+    }
+  });
+}
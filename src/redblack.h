@@ -0,0 +1,73 @@
+#pragma once
+
+#include <functional>
+
+class ThreadPool;
+struct RowSpan;
+
+// Red-black Gauss-Seidel relaxation of
+//
+//   x(i,j) = (b(i,j) + a * (sum of the four neighbours of x)) * c
+//
+// over a (w+2) x (h+2) field with a one cell halo. This is the update of
+// fluid_compute.glsl (diffuse) and project_compute_b.glsl (pressure), but
+// cells with even i + j (red) are all updated before any with odd i + j
+// (black). Each colour only reads the other one, so a sweep gives the same
+// result whatever order or thread its rows run in.
+//
+// The row kernel comes in scalar, AVX2 and AVX-512 versions, picked once at
+// startup from what the CPU supports; FLUID_SIMD=scalar|avx2|avx512 in the
+// environment forces a lower level. All three do the same float operations
+// in the same order, with no fused multiply-add, and agree bit for bit;
+// FluidBench checks this before it starts timing.
+
+enum SimdLevel { SimdScalar, SimdAvx2, SimdAvx512 };
+
+// Updates one row of w cells plus halo: x is the row itself, above and below
+// its neighbours, b the matching row of the right hand side. Only cells with
+// i + parity even are written; for row j and colour (0 red, 1 black) the
+// parity is (j + colour) & 1. Taking rows by pointer lets callers feed rows
+// from anywhere, not just a contiguous field.
+typedef void (*RedBlackRow)(int w, float* x, const float* above, const float* below, const float* b, float a, float c, int parity);
+
+SimdLevel simd_level();
+const char* simd_level_name(SimdLevel level);
+RedBlackRow redblack_row(SimdLevel level);
+
+// One full sweep, first_colour then the other one, in a single pass over
+// memory: within a band of rows the second colour trails the first by one
+// row, so each row is loaded once per sweep rather than once per colour. The
+// rows on band edges, which need the neighbouring band's first colour, are
+// finished in a second, short pass.
+void redblack_sweep(ThreadPool& pool, RedBlackRow row, int w, int h, float* x, const float* b, float a, float c, int first_colour = 0);
+
+// redblack_sweep over the given row spans only; cells outside them are left
+// alone and read as fixed neighbours. Each colour is a separate pass.
+void redblack_sweep_spans(ThreadPool& pool, RedBlackRow row, int w, const RowSpan* spans, int span_count, float* x, const float* b, float a, float c, int first_colour = 0);
+
+// redblack_sweep with obstacles. Each fluid cell only sums its open
+// neighbours, as given by its ObstacleMap flags, and scales by
+// c_by_open[open bits], a 16 entry table indexed by (flags >> 1) & 15 that
+// holds the coefficient for that many open neighbours. Bits in forced_open
+// are treated as set everywhere, so ObstacleMap::OpenAll gives the plain
+// stencil. Solid cells are set to zero.
+void redblack_sweep_masked(ThreadPool& pool, int w, int h, float* x, const float* b, const unsigned char* flags,
+                           unsigned char forced_open, float a, const float* c_by_open, int first_colour = 0);
+
+// Returns row j of the right hand side, either a pointer into an existing
+// field or `scratch` (w + 2 floats) after filling it in. `own` is true for
+// the rows of the calling band; the other rows are ghost rows that another
+// band also owns, so any side effect must be limited to own rows.
+typedef std::function<const float*(int j, float* scratch, bool own)> BlockRowSource;
+
+// `sweeps` full sweeps, red first, from x_in into x_out in a single pass over
+// memory. Within a band, sweep t + 1 trails sweep t by two rows, so the rows
+// being worked on stay in a small rolling window that fits in L2 and every
+// row of x and b is read once per pass rather than once per sweep. Each band
+// also relaxes 2 * sweeps ghost rows on either side from x_in: errors from
+// the stale rows beyond them move inward two rows per sweep, so the band's
+// own rows come out exactly as `sweeps` calls of redblack_sweep would leave
+// them. x_in and x_out must differ; x_in may be null to start from zero. If
+// b_source is set, b is ignored and rows of the right hand side come from it.
+void redblack_blocked(ThreadPool& pool, RedBlackRow row, int w, int h, int sweeps, const float* x_in, float* x_out,
+                      const float* b, float a, float c, const BlockRowSource& b_source = nullptr);
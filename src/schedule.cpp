@@ -0,0 +1,85 @@
+#include "schedule.h"
+#include "obstacles.h"
+#include "sources.h"
+
+#include <fstream>
+#include <sstream>
+
+bool Schedule::load(const char* filename, std::string& error) {
+  std::ifstream file(filename);
+  if (!file) {
+    error = std::string("could not open ") + filename;
+    return false;
+  }
+
+  std::string line;
+  int line_number = 0;
+
+  while (std::getline(file, line)) {
+    line_number++;
+
+    size_t comment = line.find('#');
+    if (comment != std::string::npos) line.erase(comment);
+
+    std::istringstream stream(line);
+    std::string kind;
+    if (!(stream >> kind)) continue;
+
+    bool ok = true;
+
+    if (kind == "n") {
+      ok = (bool)(stream >> width) && width > 0;
+      height = width;
+    } else if (kind == "size") {
+      ok = (bool)(stream >> width >> height) && width > 0 && height > 0;
+    } else if (kind == "dt") {
+      ok = (bool)(stream >> dt) && dt > 0;
+    } else if (kind == "steps") {
+      ok = (bool)(stream >> steps) && steps >= 0;
+    } else if (kind == "density") {
+      ScheduleEvent event = { ScheduleEvent::Density };
+      ok = (bool)(stream >> event.first >> event.last >> event.x >> event.y >> event.radius >> event.a);
+      events.push_back(event);
+    } else if (kind == "force") {
+      ScheduleEvent event = { ScheduleEvent::Force };
+      ok = (bool)(stream >> event.first >> event.last >> event.x >> event.y >> event.a >> event.b);
+      events.push_back(event);
+    } else if (kind == "solid") {
+      ScheduleSolid solid;
+      ok = (bool)(stream >> solid.x0 >> solid.y0 >> solid.x1 >> solid.y1);
+      solids.push_back(solid);
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      error = std::string(filename) + ":" + std::to_string(line_number) + ": could not parse '" + line + "'";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Schedule::apply(SourceBatch& batch, int step) const {
+  for (const ScheduleEvent& event : events) {
+    if (step < event.first || step > event.last) continue;
+
+    if (event.kind == ScheduleEvent::Density) {
+      batch.add_square(SourceBatch::Density, event.x, event.y, event.radius, event.a);
+    } else {
+      batch.add(SourceBatch::VelocityU, event.x, event.y, event.a);
+      batch.add(SourceBatch::VelocityV, event.x, event.y, event.b);
+    }
+  }
+}
+
+void Schedule::add_obstacles(ObstacleMap& map) const {
+  for (const ScheduleSolid& solid : solids) {
+    for (int j = solid.y0; j <= solid.y1; j++) {
+      for (int i = solid.x0; i <= solid.x1; i++) {
+        map.set_solid(i, j);
+      }
+    }
+  }
+}
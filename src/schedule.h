@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class ObstacleMap;
+class SourceBatch;
+
+// Scripted sources for headless runs, standing in for the mouse input that
+// main.cpp turns into add_liquid_point / add_force calls.
+//
+// The file is plain text, one entry per line, '#' starts a comment:
+//
+//   n 200                                  square grid size
+//   size 320 180                           width x height grid size
+//   dt 0.016666                            fixed time step
+//   steps 1000                             number of steps to run
+//   density <first> <last> <x> <y> <radius> <amount>
+//   force   <first> <last> <x> <y> <fx> <fy>
+//   solid   <x0> <y0> <x1> <y1>
+//
+// density and force entries are applied on every step in [first, last].
+// density fills the same square brush as add_liquid_point, force adds to a
+// single cell like add_force. solid marks the cells of the box
+// [x0, x1] x [y0, y1] as an obstacle for the whole run.
+struct ScheduleEvent {
+  enum Kind { Density, Force };
+
+  Kind kind;
+  int first;
+  int last;
+  int x;
+  int y;
+  int radius;
+  float a;
+  float b;
+};
+
+struct ScheduleSolid {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+};
+
+struct Schedule {
+  int width = 200;
+  int height = 200;
+  float dt = 1.0f / 60.0f;
+  int steps = 1000;
+  std::vector<ScheduleEvent> events;
+  std::vector<ScheduleSolid> solids;
+
+  // Returns false and fills in error on a malformed or unreadable file.
+  bool load(const char* filename, std::string& error);
+
+  // Adds every event active on the given step to the batch.
+  void apply(SourceBatch& batch, int step) const;
+
+  // Marks the solid boxes in the map.
+  void add_obstacles(ObstacleMap& map) const;
+};
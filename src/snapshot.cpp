@@ -0,0 +1,452 @@
+#include "snapshot.h"
+#include "codec.h"
+#include "solver.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char magic[8] = { 'F', 'L', 'U', 'I', 'D', 'S', 'N', 'P' };
+static const uint32_t version = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  int32_t width;
+  int32_t height;
+  uint32_t reserved;
+};
+
+struct ChunkHeader {
+  uint32_t field;
+  uint16_t format;
+  uint16_t compressed;
+  int64_t step;
+  uint32_t raw_size;
+  uint32_t stored_size;
+};
+
+static_assert(sizeof(FileHeader) == 24, "snapshot header must not be padded");
+static_assert(sizeof(ChunkHeader) == 24, "snapshot chunk header must not be padded");
+
+static int element_size(SnapshotFormat format) {
+  return format == SnapshotFloat32 ? 4 : format == SnapshotFloat16 ? 2 : 1;
+}
+
+static void append(std::vector<uint8_t>& out, const void* data, size_t size) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  out.insert(out.end(), bytes, bytes + size);
+}
+
+static FileHeader file_header(int width, int height) {
+  FileHeader header;
+  std::memcpy(header.magic, magic, sizeof(magic));
+  header.version = version;
+  header.width = width;
+  header.height = height;
+  header.reserved = 0;
+  return header;
+}
+
+// Scratch buffers reused between chunks.
+struct ChunkEncoder {
+  std::vector<uint8_t> raw;
+  std::vector<uint8_t> shuffled;
+
+  // Appends a chunk of count values to out: floats for the float formats,
+  // bytes for SnapshotBytes. Data that does not shrink is stored as is.
+  void encode(std::vector<uint8_t>& out, SnapshotField field, int64_t step, SnapshotFormat format, bool compress, const void* values, int count) {
+    int size = element_size(format);
+    const uint8_t* data = (const uint8_t*)values;
+
+    if (format == SnapshotFloat16) {
+      raw.resize((size_t)count * 2);
+      const float* floats = (const float*)values;
+      for (int k = 0; k < count; k++) {
+        uint16_t half = float_to_half(floats[k]);
+        std::memcpy(&raw[(size_t)k * 2], &half, 2);
+      }
+      data = raw.data();
+    }
+
+    ChunkHeader header = { (uint32_t)field, (uint16_t)format, 0, step, (uint32_t)count * size, (uint32_t)count * size };
+    size_t header_at = out.size();
+    append(out, &header, sizeof(header));
+
+    if (compress) {
+      shuffled.resize((size_t)count * size);
+      shuffle_bytes(data, shuffled.data(), count, size);
+      size_t data_at = out.size();
+      lz_compress(shuffled.data(), (int)shuffled.size(), out);
+      size_t stored = out.size() - data_at;
+      if (stored < shuffled.size()) {
+        header.compressed = 1;
+        header.stored_size = (uint32_t)stored;
+        std::memcpy(&out[header_at], &header, sizeof(header));
+        return;
+      }
+      out.resize(data_at);
+    }
+
+    append(out, data, (size_t)count * size);
+  }
+};
+
+SnapshotWriter::~SnapshotWriter() {
+  std::string error;
+  close(error);
+}
+
+bool SnapshotWriter::open(const char* path, int width, int height, const SnapshotOptions& options, std::string& error) {
+  if (!close(error)) return false;
+
+  file = std::fopen(path, "wb");
+  if (!file) {
+    error = std::string("could not create ") + path;
+    return false;
+  }
+
+  FileHeader header = file_header(width, height);
+  if (std::fwrite(&header, sizeof(header), 1, file) != 1) {
+    std::fclose(file);
+    file = nullptr;
+    error = std::string("could not write ") + path;
+    return false;
+  }
+
+  w = width;
+  h = height;
+  this->options = options;
+  if (this->options.every < 1) this->options.every = 1;
+  stopping = false;
+  failed = false;
+  frames_written = 0;
+  frames_dropped = 0;
+  next_sequence = 0;
+  for (Frame& frame : frames) frame.state = Free;
+
+  thread = std::thread(&SnapshotWriter::writer_loop, this);
+  return true;
+}
+
+bool SnapshotWriter::submit(Solver& solver, int64_t step) {
+  if (!file || step % options.every != 0) return true;
+
+  Frame* frame = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Frame& candidate : frames) {
+      if (candidate.state == Free) {
+        frame = &candidate;
+        break;
+      }
+    }
+    if (!frame) {
+      frames_dropped++;
+      return false;
+    }
+    frame->state = Filling;
+  }
+
+  // The copy is the only work done on the caller's thread.
+  int size = solver.array_size();
+  frame->fields[0].assign(solver.density(), solver.density() + size);
+  frame->fields[1].assign(solver.velocity_u(), solver.velocity_u() + size);
+  frame->fields[2].assign(solver.velocity_v(), solver.velocity_v() + size);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    frame->step = step;
+    frame->sequence = next_sequence++;
+    frame->state = Filled;
+  }
+  frame_ready.notify_one();
+  return true;
+}
+
+void SnapshotWriter::writer_loop() {
+  static const SnapshotField fields[3] = { SnapshotDensity, SnapshotVelocityU, SnapshotVelocityV };
+  SnapshotFormat format = options.half ? SnapshotFloat16 : SnapshotFloat32;
+  ChunkEncoder encoder;
+  std::vector<uint8_t> buffer;
+
+  while (true) {
+    Frame* frame = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      frame_ready.wait(lock, [this] {
+        return stopping || frames[0].state == Filled || frames[1].state == Filled;
+      });
+
+      // Oldest first, in case both buffers filled up before this woke.
+      for (Frame& candidate : frames) {
+        if (candidate.state == Filled && (!frame || candidate.sequence < frame->sequence)) frame = &candidate;
+      }
+      if (!frame) return;
+      frame->state = Writing;
+    }
+
+    buffer.clear();
+    for (int f = 0; f < 3; f++) {
+      encoder.encode(buffer, fields[f], frame->step, format, options.compress, frame->fields[f].data(), (int)frame->fields[f].size());
+    }
+
+    // Flushed per frame so a reader can follow the file while it grows.
+    bool ok = std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size() && std::fflush(file) == 0;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      frame->state = Free;
+      if (ok) frames_written++;
+      else failed = true;
+    }
+  }
+}
+
+bool SnapshotWriter::close(std::string& error) {
+  if (!file) return true;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  frame_ready.notify_one();
+  thread.join();
+
+  bool ok = !failed && std::fclose(file) == 0;
+  if (failed) std::fclose(file);
+  file = nullptr;
+
+  if (!ok) error = "could not write snapshot file";
+  return ok;
+}
+
+SnapshotReader::~SnapshotReader() {
+  close();
+}
+
+bool SnapshotReader::open(const char* path, std::string& error) {
+  close();
+
+#ifdef _WIN32
+  HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    error = std::string("could not open ") + path;
+    return false;
+  }
+  file = handle;
+
+  LARGE_INTEGER file_size;
+  GetFileSizeEx(handle, &file_size);
+  size = (size_t)file_size.QuadPart;
+  if (size > 0) {
+    mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping) base = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  }
+#else
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    error = std::string("could not open ") + path;
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == 0) size = (size_t)info.st_size;
+  if (size > 0) {
+    void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (view != MAP_FAILED) base = (const uint8_t*)view;
+  }
+  // The mapping stays valid without the descriptor.
+  ::close(fd);
+#endif
+
+  FileHeader header;
+  if (!base || size < sizeof(header)) {
+    close();
+    error = std::string(path) + ": not a snapshot file";
+    return false;
+  }
+
+  std::memcpy(&header, base, sizeof(header));
+  if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version || header.width <= 0 || header.height <= 0) {
+    close();
+    error = std::string(path) + ": not a snapshot file";
+    return false;
+  }
+  w = header.width;
+  h = header.height;
+
+  size_t at = sizeof(header);
+  while (size - at >= sizeof(ChunkHeader)) {
+    ChunkHeader chunk;
+    std::memcpy(&chunk, base + at, sizeof(chunk));
+    if (chunk.stored_size > size - at - sizeof(chunk)) break;
+    at += sizeof(chunk);
+    index.push_back(Chunk { (SnapshotField)chunk.field, (SnapshotFormat)chunk.format, chunk.compressed != 0,
+                            chunk.step, chunk.raw_size, chunk.stored_size, base + at });
+    at += chunk.stored_size;
+  }
+
+  return true;
+}
+
+void SnapshotReader::close() {
+#ifdef _WIN32
+  if (base) UnmapViewOfFile(base);
+  if (mapping) CloseHandle(mapping);
+  if (file) CloseHandle(file);
+  mapping = nullptr;
+  file = nullptr;
+#else
+  if (base) munmap((void*)base, size);
+#endif
+  base = nullptr;
+  size = 0;
+  w = h = 0;
+  index.clear();
+}
+
+std::vector<int64_t> SnapshotReader::steps() const {
+  std::vector<int64_t> out;
+  for (const Chunk& chunk : index) {
+    if (out.empty() || out.back() != chunk.step) out.push_back(chunk.step);
+  }
+  return out;
+}
+
+const SnapshotReader::Chunk* SnapshotReader::find(SnapshotField field, int64_t step) const {
+  for (size_t k = index.size(); k-- > 0;) {
+    if (index[k].field == field && index[k].step == step) return &index[k];
+  }
+  return nullptr;
+}
+
+bool SnapshotReader::read_raw(const Chunk& chunk, std::vector<uint8_t>& out) const {
+  if (chunk.format > SnapshotBytes) return false;
+  int size = element_size(chunk.format);
+  if (chunk.raw_size % size != 0) return false;
+
+  out.resize(chunk.raw_size);
+  if (!chunk.compressed) {
+    if (chunk.stored_size != chunk.raw_size) return false;
+    if (chunk.raw_size > 0) std::memcpy(out.data(), chunk.data, chunk.raw_size);
+    return true;
+  }
+
+  std::vector<uint8_t> shuffled(chunk.raw_size);
+  if (!lz_decompress(chunk.data, (int)chunk.stored_size, shuffled.data(), (int)chunk.raw_size)) return false;
+  unshuffle_bytes(shuffled.data(), out.data(), (int)(chunk.raw_size / size), size);
+  return true;
+}
+
+bool SnapshotReader::read(const Chunk& chunk, float* out) const {
+  size_t count = (size_t)(w + 2) * (h + 2);
+  if (chunk.format == SnapshotBytes || chunk.raw_size != count * element_size(chunk.format)) return false;
+
+  std::vector<uint8_t> raw;
+  if (!read_raw(chunk, raw)) return false;
+
+  if (chunk.format == SnapshotFloat32) {
+    std::memcpy(out, raw.data(), raw.size());
+    return true;
+  }
+
+  for (size_t k = 0; k < count; k++) {
+    uint16_t half;
+    std::memcpy(&half, &raw[k * 2], 2);
+    out[k] = half_to_float(half);
+  }
+  return true;
+}
+
+bool save_checkpoint(const char* path, const Solver& solver, int64_t step, std::string& error) {
+  const float* fields[6] = {
+    solver.density(), solver.velocity_u(), solver.velocity_v(),
+    solver.density_source(), solver.velocity_u_source(), solver.velocity_v_source(),
+  };
+
+  std::vector<uint8_t> buffer;
+  FileHeader header = file_header(solver.width(), solver.height());
+  append(buffer, &header, sizeof(header));
+
+  ChunkEncoder encoder;
+  for (int f = 0; f < 6; f++) {
+    encoder.encode(buffer, (SnapshotField)(SnapshotDensity + f), step, SnapshotFloat32, true, fields[f], solver.array_size());
+  }
+  const std::vector<unsigned char>& tiles = solver.tile_state();
+  encoder.encode(buffer, SnapshotTiles, step, SnapshotBytes, true, tiles.data(), (int)tiles.size());
+
+  std::string temporary = std::string(path) + ".tmp";
+  FILE* file = std::fopen(temporary.c_str(), "wb");
+  if (!file) {
+    error = std::string("could not create ") + temporary;
+    return false;
+  }
+  bool ok = std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+  ok = std::fclose(file) == 0 && ok;
+
+  // rename does not replace an existing file on Windows.
+  if (ok && std::rename(temporary.c_str(), path) != 0) {
+    std::remove(path);
+    ok = std::rename(temporary.c_str(), path) == 0;
+  }
+  if (!ok) {
+    std::remove(temporary.c_str());
+    error = std::string("could not write ") + path;
+  }
+  return ok;
+}
+
+bool load_checkpoint(const char* path, Solver& solver, int64_t& step, std::string& error) {
+  SnapshotReader reader;
+  if (!reader.open(path, error)) return false;
+
+  if (reader.width() != solver.width() || reader.height() != solver.height()) {
+    error = std::string(path) + ": checkpoint is for a " + std::to_string(reader.width()) + "x" + std::to_string(reader.height()) + " grid";
+    return false;
+  }
+  if (reader.chunks().empty()) {
+    error = std::string(path) + ": checkpoint is empty";
+    return false;
+  }
+
+  int64_t saved_step = reader.chunks().back().step;
+  std::vector<float> fields[6];
+  std::vector<uint8_t> tiles;
+
+  for (int f = 0; f < 6; f++) {
+    const SnapshotReader::Chunk* chunk = reader.find((SnapshotField)(SnapshotDensity + f), saved_step);
+    fields[f].resize(solver.array_size());
+    if (!chunk || chunk->format != SnapshotFloat32 || !reader.read(*chunk, fields[f].data())) {
+      error = std::string(path) + ": checkpoint is incomplete";
+      return false;
+    }
+  }
+
+  const SnapshotReader::Chunk* chunk = reader.find(SnapshotTiles, saved_step);
+  if (!chunk || !reader.read_raw(*chunk, tiles) || tiles.size() != solver.tile_state().size()) {
+    error = std::string(path) + ": checkpoint is incomplete";
+    return false;
+  }
+
+  float* targets[6] = {
+    solver.density(), solver.velocity_u(), solver.velocity_v(),
+    solver.density_source(), solver.velocity_u_source(), solver.velocity_v_source(),
+  };
+  for (int f = 0; f < 6; f++) {
+    std::memcpy(targets[f], fields[f].data(), fields[f].size() * sizeof(float));
+  }
+  solver.restore_tile_state(std::vector<unsigned char>(tiles.begin(), tiles.end()));
+
+  step = saved_step;
+  return true;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Solver;
+
+// Snapshot files hold fields of a run: a stream of frames for
+// post-processing, or a checkpoint that a run can resume from.
+//
+// A file is a header followed by chunks, each holding one field of one
+// step:
+//
+//   header  char[8] "FLUIDSNP", u32 version, i32 width, i32 height, u32 0
+//   chunk   u32 field, u16 format, u16 compressed, i64 step,
+//           u32 raw bytes, u32 stored bytes, then the stored bytes
+//
+// Values are in host byte order, little endian on every platform the
+// project builds for. A float field covers the full (width+2) x (height+2)
+// grid, halo included, in the solver's layout; step is the number of steps
+// run when it was taken. Compressed data is byte shuffled (shuffle_bytes)
+// and then LZ compressed (lz_compress); raw bytes is its size before
+// compression. A reader stops at a truncated chunk, so a file being
+// written or cut short by a crash still reads up to its last whole chunk.
+enum SnapshotField {
+  SnapshotDensity,
+  SnapshotVelocityU,
+  SnapshotVelocityV,
+  SnapshotDensitySource,
+  SnapshotVelocityUSource,
+  SnapshotVelocityVSource,
+  // ActiveTiles::state, one byte per tile.
+  SnapshotTiles,
+};
+
+enum SnapshotFormat { SnapshotFloat32, SnapshotFloat16, SnapshotBytes };
+
+struct SnapshotOptions {
+  // Steps between frames.
+  int every = 1;
+  // Stores float16 instead of float32, halving the size at about three
+  // significant digits.
+  bool half = false;
+  bool compress = false;
+};
+
+// Streams density and velocity to a snapshot file from a background thread.
+// submit copies the fields into one of two frame buffers and returns; the
+// thread converts, compresses and writes them while the run carries on. If
+// the disk falls behind so that both buffers are still waiting, the frame is
+// dropped rather than stalling the step loop, and counted in dropped().
+class SnapshotWriter {
+public:
+  SnapshotWriter() = default;
+  ~SnapshotWriter();
+
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+  // Returns false and fills in error if the file cannot be created.
+  bool open(const char* path, int width, int height, const SnapshotOptions& options, std::string& error);
+
+  // Takes a frame of the solver's fields if step is a multiple of
+  // options.every. Returns false if the frame was due but dropped.
+  bool submit(Solver& solver, int64_t step);
+
+  // Writes the frames still buffered and closes the file. Returns false and
+  // fills in error if any write failed.
+  bool close(std::string& error);
+
+  int written() const { return frames_written; }
+  int dropped() const { return frames_dropped; }
+
+private:
+  enum FrameState { Free, Filling, Filled, Writing };
+
+  struct Frame {
+    FrameState state = Free;
+    int64_t step = 0;
+    // Submission order, so frames are written in the order they were taken.
+    uint64_t sequence = 0;
+    std::vector<float> fields[3];
+  };
+
+  void writer_loop();
+
+  FILE* file = nullptr;
+  int w = 0, h = 0;
+  SnapshotOptions options;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable frame_ready;
+  Frame frames[2];
+  bool stopping = false;
+  bool failed = false;
+  uint64_t next_sequence = 0;
+  std::atomic<int> frames_written { 0 };
+  int frames_dropped = 0;
+};
+
+// Reads a snapshot file through a read only memory mapping, so opening a
+// long run costs one pass over the chunk headers and frames are decoded
+// straight from the page cache on demand.
+class SnapshotReader {
+public:
+  struct Chunk {
+    SnapshotField field;
+    SnapshotFormat format;
+    bool compressed;
+    int64_t step;
+    uint32_t raw_size;
+    uint32_t stored_size;
+    // Stored bytes, inside the mapping.
+    const uint8_t* data;
+  };
+
+  SnapshotReader() = default;
+  ~SnapshotReader();
+
+  SnapshotReader(const SnapshotReader&) = delete;
+  SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+  // Returns false and fills in error if the file is missing or is not a
+  // snapshot file.
+  bool open(const char* path, std::string& error);
+  void close();
+
+  int width() const { return w; }
+  int height() const { return h; }
+
+  // Every whole chunk, in file order.
+  const std::vector<Chunk>& chunks() const { return index; }
+
+  // The distinct steps that have chunks, in file order.
+  std::vector<int64_t> steps() const;
+
+  // The last chunk of field at step, or null.
+  const Chunk* find(SnapshotField field, int64_t step) const;
+
+  // Decodes a float chunk into (width+2) * (height+2) floats. Returns false
+  // if the chunk is not a float field of that size or is corrupt.
+  bool read(const Chunk& chunk, float* out) const;
+
+  // Decompresses a chunk into its raw bytes.
+  bool read_raw(const Chunk& chunk, std::vector<uint8_t>& out) const;
+
+private:
+  const uint8_t* base = nullptr;
+  size_t size = 0;
+#ifdef _WIN32
+  void* file = nullptr;
+  void* mapping = nullptr;
+#endif
+  int w = 0, h = 0;
+  std::vector<Chunk> index;
+};
+
+// Checkpoints store everything one step reads from the previous one, so a
+// run resumed from a checkpoint continues bit for bit as if it had never
+// stopped: density, velocity and the source fields as float32, compressed
+// losslessly, and the sparse tile state. Settings such as diff, iterations or
+// the obstacles are not stored and have to be set up as they were. step is
+// the number of steps run so far. The file is written under a temporary
+// name and renamed into place, so a crash leaves the previous checkpoint.
+bool save_checkpoint(const char* path, const Solver& solver, int64_t step, std::string& error);
+
+// Restores a checkpoint into a solver of the same size. Returns false and
+// fills in error, leaving the solver untouched, if the file is unreadable,
+// incomplete or for another grid size.
+bool load_checkpoint(const char* path, Solver& solver, int64_t& step, std::string& error);
@@ -1,9 +1,533 @@
 #include "solver.h"
+#include "sources.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Number of open neighbours in the four open bits of ObstacleMap flags >> 1.
+static int open_count(int bits) {
+  return (bits & 1) + ((bits >> 1) & 1) + ((bits >> 2) & 1) + ((bits >> 3) & 1);
+}
+
+Solver::Solver(int width, int height, int threads) :
+  w(width),
+  h(height),
+  n(std::max(width, height)),
+  kernels(select_kernels(width, height)),
+  redblack(redblack_row(simd_level())),
+  u(array_size(), 0.0f),
+  v(array_size(), 0.0f),
+  up(array_size(), 0.0f),
+  vp(array_size(), 0.0f),
+  dens(array_size(), 0.0f),
+  dens_prev(array_size(), 0.0f),
+  scratch(array_size(), 0.0f),
+  rhs(array_size(), 0.0f),
+  pool(threads),
+  tiles(width, height, pool) {
 
-Solver::Solver() {
-  std::cout << "Solver has been created!" << std::endl;
 }
 
 Solver::~Solver() {
 
 }
+
+void Solver::set_obstacles(const ObstacleMap& map) {
+  if (map.empty()) {
+    cell_flags.clear();
+    return;
+  }
+
+  cell_flags = map.flags();
+
+  for (std::vector<float>* field : { &u, &v, &up, &vp, &dens, &dens_prev }) {
+    for (int k = 0; k < array_size(); k++) {
+      if (!(cell_flags[k] & ObstacleMap::Fluid)) (*field)[k] = 0.0f;
+    }
+  }
+}
+
+void Solver::clear_sources() {
+  if (!sources_tracked) {
+    std::fill(up.begin(), up.end(), 0.0f);
+    std::fill(vp.begin(), vp.end(), 0.0f);
+    std::fill(dens_prev.begin(), dens_prev.end(), 0.0f);
+  } else {
+    int stride = w + 2;
+    pool.parallel_rows(0, (int)dirty_spans.size(), [&](int span_begin, int span_end) {
+      for (int s = span_begin; s < span_end; s++) {
+        const RowSpan& span = dirty_spans[s];
+        for (float* field : { up.data(), vp.data(), dens_prev.data() }) {
+          std::fill(field + span.col_begin + stride * span.j, field + span.col_end + stride * span.j, 0.0f);
+        }
+      }
+    });
+    for (int k : source_cells) up[k] = vp[k] = dens_prev[k] = 0.0f;
+  }
+
+  source_cells.clear();
+  dirty_spans.clear();
+  sources_tracked = true;
+}
+
+void Solver::add_sources(const SourceBatch& batch) {
+  float* fields[] = { dens_prev.data(), up.data(), vp.data() };
+  for (const SourceBatch::Splat& splat : batch.entries()) {
+    fields[splat.field][splat.cell] += splat.value;
+    source_cells.push_back(splat.cell);
+  }
+}
+
+void Solver::step(float dt) {
+  steps_taken++;
+
+  if (!sparse || !cell_flags.empty()) {
+    FLUID_TRACE_SCOPE("step", traced_cells());
+    tiles.mark_all();
+    velocity_step(dt);
+    density_step(dt);
+    source_cells.clear();
+    sources_tracked = false;
+  } else {
+    if (sources_tracked) {
+      // Only the cells sources were added to can be nonzero. A cell whose
+      // splats cancel out is skipped, as the scan below would skip it.
+      FLUID_TRACE_SCOPE("mark_tiles", (int64_t)source_cells.size());
+      for (int k : source_cells) {
+        if (up[k] != 0.0f || vp[k] != 0.0f || dens_prev[k] != 0.0f) tiles.mark_cell(k);
+      }
+    } else {
+      FLUID_TRACE_SCOPE("mark_tiles", (int64_t)w * h);
+      tiles.mark_nonzero(up.data());
+      tiles.mark_nonzero(vp.data());
+      tiles.mark_nonzero(dens_prev.data());
+    }
+    source_cells.clear();
+
+    region = &tiles.rows();
+    region_cells = 0;
+    for (const RowSpan& span : *region) region_cells += span.col_end - span.col_begin;
+
+    // Opened once the region is known, so the span counts its cells.
+    FLUID_TRACE_SCOPE("step", traced_cells());
+    velocity_step(dt);
+    density_step(dt);
+    dirty_spans = *region;
+    region = nullptr;
+
+    tiles.update(activity_threshold, { dens.data(), u.data(), v.data() });
+    FLUID_TRACE_COUNTER("active_tiles", tiles.active_count());
+  }
+
+#if FLUID_TRACE
+  if (trace_active() && invariants_every > 0 && steps_taken % invariants_every == 0) record_invariants();
+#endif
+}
+
+// After a step up and vp still hold the pressure and divergence of the last
+// projection, and scratch and rhs are free.
+void Solver::record_invariants() {
+  FLUID_TRACE_SCOPE("invariants", (int64_t)w * h);
+  int stride = w + 2;
+  const unsigned char* flags = cell_flags.empty() ? nullptr : cell_flags.data();
+  std::vector<double> row_sums(3 * (h + 2), 0.0);
+
+  // Relative residual of the pressure solve, with the operator it relaxed:
+  // open count times p minus the open neighbours, 4p minus all four without
+  // obstacles.
+  const float* p = up.data();
+  const float* div = vp.data();
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    for (int j = row_begin; j < row_end; j++) {
+      double rr = 0.0, bb = 0.0;
+      for (int i = 1; i <= w; i++) {
+        int k = i + stride * j;
+        int bits = flags ? flags[k] : ObstacleMap::Fluid | ObstacleMap::OpenAll;
+        if (!(bits & ObstacleMap::Fluid)) continue;
+        float neighbours = ((bits & ObstacleMap::OpenLeft) ? p[k - 1] : 0.0f) + ((bits & ObstacleMap::OpenRight) ? p[k + 1] : 0.0f) +
+                           ((bits & ObstacleMap::OpenDown) ? p[k - stride] : 0.0f) + ((bits & ObstacleMap::OpenUp) ? p[k + stride] : 0.0f);
+        float residual = div[k] - (open_count(bits >> 1) * p[k] - neighbours);
+        rr += (double)residual * residual;
+        bb += (double)div[k] * div[k];
+      }
+      row_sums[3 * j] = rr;
+      row_sums[3 * j + 1] = bb;
+    }
+  });
+
+  double rr = 0.0, bb = 0.0;
+  for (int j = 1; j <= h; j++) {
+    rr += row_sums[3 * j];
+    bb += row_sums[3 * j + 1];
+  }
+
+  // Divergence left in the velocity field, formed by the divergence kernel
+  // into the free buffers, and the total density.
+  float cell = 1.0f / n;
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    if (flags) kernels.divergence_masked(w, h, row_begin, row_end, u.data(), v.data(), scratch.data(), rhs.data(), cell, flags);
+    else kernels.divergence(w, h, row_begin, row_end, u.data(), v.data(), scratch.data(), rhs.data(), cell);
+
+    for (int j = row_begin; j < row_end; j++) {
+      double dd = 0.0, mass = 0.0;
+      for (int i = 1; i <= w; i++) {
+        int k = i + stride * j;
+        dd += (double)rhs[k] * rhs[k];
+        mass += dens[k];
+      }
+      row_sums[3 * j] = dd;
+      row_sums[3 * j + 1] = mass;
+    }
+  });
+
+  double dd = 0.0, mass = 0.0;
+  for (int j = 1; j <= h; j++) {
+    dd += row_sums[3 * j];
+    mass += row_sums[3 * j + 1];
+  }
+
+  FLUID_TRACE_COUNTER("pressure_residual", bb > 0.0 ? std::sqrt(rr / bb) : 0.0);
+  // The divergence kernel forms -div(u) * cell^2, the right hand side of the
+  // pressure solve; scaling back gives the divergence itself.
+  FLUID_TRACE_COUNTER("divergence_rms", std::sqrt(dd / ((double)w * h)) * n * n);
+  FLUID_TRACE_COUNTER("mass", mass);
+}
+
+void Solver::each_span(const std::function<void(const RowSpan&)>& fn) {
+  pool.parallel_rows(0, (int)region->size(), [&](int span_begin, int span_end) {
+    for (int s = span_begin; s < span_end; s++) fn((*region)[s]);
+  });
+}
+
+// Mirrors the order of compute dispatches in main.cpp.
+void Solver::velocity_step(float dt) {
+  FLUID_TRACE_SCOPE("velocity_step", traced_cells());
+  if (use_fused()) {
+    fused_diffuse(up.data(), u.data(), visc, dt);
+    fused_diffuse(vp.data(), v.data(), visc, dt);
+
+    fused_project(up.data(), vp.data(), u.data(), v.data());
+
+    if (advection == SemiLagrangian) {
+      FLUID_TRACE_SCOPE("advect_velocity", traced_cells());
+      pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+        kernels.advect_velocity(w, h, row_begin, row_end, u.data(), v.data(), up.data(), vp.data(), up.data(), vp.data(), dt * n);
+      });
+    } else {
+      advect(u.data(), up.data(), up.data(), vp.data(), dt);
+      advect(v.data(), vp.data(), up.data(), vp.data(), dt);
+    }
+
+    fused_project(u.data(), v.data(), up.data(), vp.data());
+    return;
+  }
+
+  add_source(u.data(), up.data(), dt);
+  add_source(v.data(), vp.data(), dt);
+
+  diffuse(up.data(), u.data(), visc, dt, NoSlip);
+  diffuse(vp.data(), v.data(), visc, dt, NoSlip);
+
+  project(up.data(), vp.data(), u.data(), v.data());
+
+  advect(u.data(), up.data(), up.data(), vp.data(), dt);
+  advect(v.data(), vp.data(), up.data(), vp.data(), dt);
+
+  project(u.data(), v.data(), up.data(), vp.data());
+}
+
+void Solver::density_step(float dt) {
+  FLUID_TRACE_SCOPE("density_step", traced_cells());
+  if (use_fused()) {
+    fused_diffuse(dens_prev.data(), dens.data(), diff, dt);
+    advect(dens.data(), dens_prev.data(), u.data(), v.data(), dt);
+    return;
+  }
+
+  add_source(dens.data(), dens_prev.data(), dt);
+  diffuse(dens_prev.data(), dens.data(), diff, dt);
+  advect(dens.data(), dens_prev.data(), u.data(), v.data(), dt);
+}
+
+// add_compute.glsl
+void Solver::add_source(float* dest, const float* src, float dt) {
+  FLUID_TRACE_SCOPE("add_source", traced_cells());
+  if (region) {
+    each_span([&](const RowSpan& span) {
+      kernels.add_source_span(w, h, span.j, span.col_begin, span.col_end, dest, src, dt);
+    });
+    return;
+  }
+
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    kernels.add_source(w, h, row_begin, row_end, dest, src, dt);
+  });
+}
+
+// fluid_compute.glsl, relaxing dest towards (src + a * neighbours) / (1 + 4a)
+// starting from whatever dest currently holds. Next to obstacles a Reflect
+// field relaxes towards (src + a * open neighbours) / (1 + a * open count).
+void Solver::diffuse(float* dest, const float* src, float diff, float dt, Boundary boundary) {
+  FLUID_TRACE_SCOPE("diffuse", traced_cells());
+  float a = dt * diff * n * n;
+  float c = 1.0f / (1 + 4 * a);
+
+  if (!cell_flags.empty()) {
+    float c_by_open[16];
+    for (int bits = 0; bits < 16; bits++) {
+      c_by_open[bits] = 1.0f / (1 + open_count(bits) * a);
+    }
+    unsigned char forced_open = boundary == NoSlip ? ObstacleMap::OpenAll : 0;
+    for (int k = 0; k < iterations; k++) {
+      redblack_sweep_masked(pool, w, h, dest, src, cell_flags.data(), forced_open, a, c_by_open);
+    }
+    return;
+  }
+
+  if (region) {
+    for (int k = 0; k < iterations; k++) {
+      redblack_sweep_spans(pool, redblack, w, region->data(), (int)region->size(), dest, src, a, c);
+    }
+    return;
+  }
+
+  if (relaxation == RedBlack) {
+    for (int k = 0; k < iterations; k++) {
+      redblack_sweep(pool, redblack, w, h, dest, src, a, c);
+    }
+    return;
+  }
+
+  float* x = dest;
+  float* x_next = scratch.data();
+
+  for (int k = 0; k < iterations; k++) {
+    pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+      kernels.relax(w, h, row_begin, row_end, x_next, x, src, a, c);
+    });
+    std::swap(x, x_next);
+  }
+
+  if (x != dest) std::memcpy(dest, x, array_size() * sizeof(float));
+}
+
+// project_compute_a/b/c.glsl. p and div are scratch fields; vel_u and vel_v are
+// made divergence free in place.
+void Solver::project(float* vel_u, float* vel_v, float* p, float* div) {
+  FLUID_TRACE_SCOPE("project", traced_cells());
+  divergence(vel_u, vel_v, p, div);
+  pressure_solve(p, div);
+  subtract_gradient(vel_u, vel_v, p);
+}
+
+// project_compute_a.glsl
+void Solver::divergence(const float* vel_u, const float* vel_v, float* p, float* div) {
+  FLUID_TRACE_SCOPE("divergence", traced_cells());
+  float cell = 1.0f / n;
+
+  if (region) {
+    each_span([&](const RowSpan& span) {
+      kernels.divergence_span(w, h, span.j, span.col_begin, span.col_end, vel_u, vel_v, p, div, cell);
+    });
+    return;
+  }
+
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    if (cell_flags.empty()) kernels.divergence(w, h, row_begin, row_end, vel_u, vel_v, p, div, cell);
+    else kernels.divergence_masked(w, h, row_begin, row_end, vel_u, vel_v, p, div, cell, cell_flags.data());
+  });
+}
+
+// project_compute_b.glsl. With obstacles each fluid cell relaxes towards
+// (div + open neighbours) / open count, a zero-gradient wall.
+void Solver::pressure_solve(float* p, const float* div) {
+  FLUID_TRACE_SCOPE("pressure_solve", traced_cells());
+  if (!cell_flags.empty()) {
+    float c_by_open[16];
+    for (int bits = 0; bits < 16; bits++) {
+      c_by_open[bits] = open_count(bits) > 0 ? 1.0f / open_count(bits) : 0.0f;
+    }
+    last_pressure_method = Sweeps;
+    last_pressure_iterations = iterations;
+    for (int k = 0; k < iterations; k++) {
+      redblack_sweep_masked(pool, w, h, p, div, cell_flags.data(), 0, 1.0f, c_by_open);
+    }
+    return;
+  }
+
+  // A sparse step relaxes only its own spans: multigrid would write p, which
+  // becomes a velocity field, across the whole grid.
+  if (pressure_method == Multigrid && !region) {
+    if (!multigrid) multigrid = std::make_unique<MultigridPoisson>(w, h, pool);
+    last_pressure_method = Multigrid;
+    last_pressure_iterations = multigrid->solve(p, div, pressure_tolerance, pressure_max_iterations);
+    FLUID_TRACE_COUNTER("pressure_iterations", last_pressure_iterations);
+    FLUID_TRACE_COUNTER("multigrid_residual", multigrid->residual());
+    return;
+  }
+
+  last_pressure_method = Sweeps;
+  last_pressure_iterations = iterations;
+
+  if (region) {
+    for (int k = 0; k < iterations; k++) {
+      redblack_sweep_spans(pool, redblack, w, region->data(), (int)region->size(), p, div, 1.0f, 0.25f);
+    }
+    return;
+  }
+
+  if (relaxation == RedBlack) {
+    for (int k = 0; k < iterations; k++) {
+      redblack_sweep(pool, redblack, w, h, p, div, 1.0f, 0.25f);
+    }
+    return;
+  }
+
+  float* x = p;
+  float* x_next = scratch.data();
+
+  for (int k = 0; k < iterations; k++) {
+    pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+      kernels.relax(w, h, row_begin, row_end, x_next, x, div, 1.0f, 0.25f);
+    });
+    std::swap(x, x_next);
+  }
+
+  if (x != p) std::memcpy(p, x, array_size() * sizeof(float));
+}
+
+// project_compute_c.glsl
+void Solver::subtract_gradient(float* vel_u, float* vel_v, const float* p) {
+  FLUID_TRACE_SCOPE("subtract_gradient", traced_cells());
+  float cell = 1.0f / n;
+
+  if (region) {
+    each_span([&](const RowSpan& span) {
+      kernels.subtract_gradient_span(w, h, span.j, span.col_begin, span.col_end, vel_u, vel_v, p, cell);
+    });
+    return;
+  }
+
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    if (cell_flags.empty()) kernels.subtract_gradient(w, h, row_begin, row_end, vel_u, vel_v, p, cell);
+    else kernels.subtract_gradient_masked(w, h, row_begin, row_end, vel_u, vel_v, p, cell, cell_flags.data());
+  });
+}
+
+// advection_compute.glsl
+void Solver::advect(float* dest, const float* src, const float* vel_u, const float* vel_v, float dt) {
+  FLUID_TRACE_SCOPE("advect", traced_cells());
+  float dt0 = dt * n;
+
+  if (region) {
+    each_span([&](const RowSpan& span) {
+      kernels.advect_span(w, h, span.j, span.col_begin, span.col_end, dest, src, vel_u, vel_v, dt0);
+    });
+    return;
+  }
+
+  if (advection == SemiLagrangian || !cell_flags.empty()) {
+    pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+      if (cell_flags.empty()) kernels.advect(w, h, row_begin, row_end, dest, src, vel_u, vel_v, dt0);
+      else kernels.advect_masked(w, h, row_begin, row_end, dest, src, vel_u, vel_v, dt0, cell_flags.data());
+    });
+    return;
+  }
+
+  // The correction passes sample the forward result around the halo too,
+  // where it has to read as zero like every other field.
+  float* forward = scratch.data();
+  clear_halo(forward);
+
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    kernels.advect(w, h, row_begin, row_end, forward, src, vel_u, vel_v, dt0);
+  });
+
+  if (advection == MacCormack) {
+    pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+      kernels.maccormack_correct(w, h, row_begin, row_end, dest, forward, src, vel_u, vel_v, dt0);
+    });
+    return;
+  }
+
+  float* compensated = rhs.data();
+  clear_halo(compensated);
+
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    kernels.bfecc_compensate(w, h, row_begin, row_end, compensated, forward, src, vel_u, vel_v, dt0);
+  });
+  pool.parallel_rows(1, h + 1, [&](int row_begin, int row_end) {
+    kernels.advect_clamped(w, h, row_begin, row_end, dest, compensated, src, vel_u, vel_v, dt0);
+  });
+}
+
+void Solver::clear_halo(float* field) {
+  int stride = w + 2;
+  std::fill(field, field + stride, 0.0f);
+  std::fill(field + stride * (h + 1), field + stride * (h + 2), 0.0f);
+  for (int j = 1; j <= h; j++) {
+    field[stride * j] = 0.0f;
+    field[stride * j + w + 1] = 0.0f;
+  }
+}
+
+// add_source(src, dest) followed by diffuse(dest, src), with the sum formed
+// row by row as the first relaxation pass needs it.
+void Solver::fused_diffuse(float* dest, float* src, float diff, float dt) {
+  FLUID_TRACE_SCOPE("fused_diffuse", traced_cells());
+  int stride = w + 2;
+  float a = dt * diff * n * n;
+  float c = 1.0f / (1 + 4 * a);
+
+  relax_blocked(dest, false, rhs.data(), [&](int j, float* out, bool own) {
+    kernels.add_source_row(w, h, j, out, src, dest, dt);
+    if (own) std::memcpy(rhs.data() + stride * j, out, stride * sizeof(float));
+    return (const float*)out;
+  }, a, c);
+}
+
+// project with the divergence formed row by row inside the first pressure
+// pass. Falls back to project when the pressure solve is not red-black sweeps.
+void Solver::fused_project(float* vel_u, float* vel_v, float* p, float* div) {
+  FLUID_TRACE_SCOPE("fused_project", traced_cells());
+  if (pressure_method != Sweeps) {
+    project(vel_u, vel_v, p, div);
+    return;
+  }
+
+  int stride = w + 2;
+  float cell = 1.0f / n;
+  last_pressure_method = Sweeps;
+  last_pressure_iterations = iterations;
+
+  relax_blocked(p, true, div, [&](int j, float* out, bool own) {
+    kernels.divergence_row(w, h, j, out, vel_u, vel_v, cell);
+    if (own) std::memcpy(div + stride * j, out, stride * sizeof(float));
+    return (const float*)out;
+  }, 1.0f, 0.25f);
+
+  subtract_gradient(vel_u, vel_v, p);
+}
+
+// `iterations` red-black sweeps on x in passes of sweeps_per_pass, ping-ponging
+// through scratch. The first pass takes its right hand side from first_b,
+// which must also store it into b for the passes after it.
+void Solver::relax_blocked(float* x, bool from_zero, const float* b, const BlockRowSource& first_b, float a, float c) {
+  int per_pass = std::max(1, sweeps_per_pass);
+  int passes = (iterations + per_pass - 1) / per_pass;
+
+  // Starting from zero, the first pass can write x when that makes the last
+  // one land there; otherwise it reads x and has to write scratch.
+  const float* in = from_zero ? nullptr : x;
+  float* out = (from_zero && passes % 2 == 1) ? x : scratch.data();
+
+  for (int done = 0; done < iterations; done += per_pass) {
+    int sweeps = std::min(per_pass, iterations - done);
+    redblack_blocked(pool, redblack, w, h, sweeps, in, out, b, a, c, done == 0 ? first_b : BlockRowSource());
+    in = out;
+    out = (out == x) ? scratch.data() : x;
+  }
+
+  if (in != x) std::memcpy(x, in, array_size() * sizeof(float));
+}
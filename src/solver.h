@@ -1,13 +1,226 @@
+#pragma once
+
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <vector>
+
+#include "active_tiles.h"
+#include "kernels.h"
+#include "multigrid.h"
+#include "obstacles.h"
+#include "redblack.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+class SourceBatch;
 
+// CPU implementation of the stable-fluids step that main.cpp runs through the
+// compute shaders. Fields use the same (W+2)*(H+2) layout as the shader
+// buffers, with a one cell halo that is never written (zero boundaries).
+// Cells are square with side 1 / max(W, H), so the longer side of the domain
+// has length one.
+//
+// Tolerance against the GPU path: add_source and advect do the same float
+// operations as the shaders and match to rounding. Diffuse and the pressure
+// solve are relaxations that are not iterated to convergence. The shaders
+// relax in place in whatever order invocations happen to run; the CPU path
+// uses red-black Gauss-Seidel (or Jacobi) sweeps so row bands can run on
+// separate threads and the output is deterministic. All of them converge to
+// the same solution, so the two paths agree to within the residual the
+// relaxation leaves behind. Measured after one step from the same state
+// with a strong point impulse on a 200x200 grid, red-black sweeps against a
+// sequential in-place sweep differ by up to about a third of peak density
+// and an eighth of peak velocity at the default 20 sweeps, and by under
+// 0.02% at 1000 sweeps. Jacobi converges more slowly and differs by about
+// twice as much. Raise `iterations`, or use the multigrid pressure solve,
+// when a tighter comparison is needed.
 class Solver {
 public:
-  Solver();
+  Solver(int width, int height, int threads = 0);
   ~Solver();
 
+  // Full frame: velocity step followed by density step.
+  void step(float dt);
+  void velocity_step(float dt);
+  void density_step(float dt);
+
+  // Zeroes the source arrays. Sources are consumed as scratch space during a
+  // step, so this has to be called before filling in the next frame's sources.
+  // After a sparse step only the spans it covered and the cells sources were
+  // added to are cleared, unless the source fields were written through the
+  // pointers below.
+  void clear_sources();
+
+  // Adds every splat of the batch to the source fields (SourceBatch::apply).
+  // The cells are remembered, so a sparse step marks their tiles directly.
+  void add_sources(const SourceBatch& batch);
+
+  int index(int x, int y) const { return x + (w + 2) * y; }
+  int width() const { return w; }
+  int height() const { return h; }
+  int array_size() const { return (w + 2) * (h + 2); }
+  int thread_count() const { return pool.size(); }
+
+  float* density() { return dens.data(); }
+  float* velocity_u() { return u.data(); }
+  float* velocity_v() { return v.data(); }
+
+  const float* density() const { return dens.data(); }
+  const float* velocity_u() const { return u.data(); }
+  const float* velocity_v() const { return v.data(); }
+
+  // The sources can be written anywhere through these, so until the next
+  // clear_sources a sparse step has to scan all three for them, and
+  // clear_sources has to clear them in full.
+  float* density_source() { sources_tracked = false; return dens_prev.data(); }
+  float* velocity_u_source() { sources_tracked = false; return up.data(); }
+  float* velocity_v_source() { sources_tracked = false; return vp.data(); }
+
+  const float* density_source() const { return dens_prev.data(); }
+  const float* velocity_u_source() const { return up.data(); }
+  const float* velocity_v_source() const { return vp.data(); }
+
+  // Solid cells from the map become obstacles: velocity is held at zero in
+  // them (no slip), and density and pressure see a reflecting wall, each
+  // fluid cell relaxing against its open neighbours only. The map's flags
+  // are built once here and the fields are cleared inside solids. With
+  // obstacles the relaxation is always red-black, the pressure solve always
+  // uses sweeps, and the fused passes are not used. An empty map removes
+  // the obstacles again.
+  void set_obstacles(const ObstacleMap& map);
+  bool has_obstacles() const { return !cell_flags.empty(); }
+
+  // How a field behaves at obstacles: Reflect for density, NoSlip for the
+  // velocity components.
+  enum Boundary { Reflect, NoSlip };
 
+  // Relaxation used for the `iterations` sweeps of diffuse and of the
+  // Sweeps pressure solve. RedBlack runs in place and converges about twice
+  // as fast per sweep as Jacobi, which needs a second buffer.
+  enum Relaxation { Jacobi, RedBlack };
+
+  // Sweeps relaxes `iterations` times like project_compute_b. Multigrid runs
+  // multigrid preconditioned CG until the pressure residual drops below
+  // pressure_tolerance relative to the divergence, or pressure_max_iterations
+  // is reached.
+  enum PressureMethod { Sweeps, Multigrid };
+
+  // How advect carries fields along the flow. SemiLagrangian is the first
+  // order backtrace of advection_compute.glsl, which smears sharp features
+  // a little more every step. MacCormack adds a pass that advects the
+  // result back, and corrects by half the error that reveals; Bfecc advects
+  // back, compensates the source by half the error and advects it again.
+  // Both are second order, and both clamp each cell to the four values its
+  // backtrace interpolated between, so they cannot overshoot. None of the
+  // three conserves mass exactly. With obstacles or during sparse steps
+  // advect always uses SemiLagrangian.
+  enum Advection { SemiLagrangian, MacCormack, Bfecc };
+
+  float diff = 0.0003f;
+  float visc = 0.0f;
+  int iterations = 20;
+  Relaxation relaxation = RedBlack;
+  PressureMethod pressure_method = Sweeps;
+  Advection advection = SemiLagrangian;
+  float pressure_tolerance = 1e-4f;
+  int pressure_max_iterations = 50;
+
+  // With red-black relaxation, step runs fused passes instead of one pass per
+  // stage: add_source feeds the first diffuse pass and divergence the first
+  // pressure pass row by row, sweeps_per_pass sweeps share each pass over
+  // memory (see redblack_blocked), and both velocity components are advected
+  // together. The result is bit for bit the same as the separate stages, but
+  // the source fields are no longer left holding dest + src * dt, which the
+  // step overwrites anyway. Fusing only pays once the fields no longer fit
+  // in cache, so step only fuses grids of at least fused_min_cells interior
+  // cells; 0 fuses every size.
+  bool fused = true;
+  int64_t fused_min_cells = 1536 * 1536;
+  int sweeps_per_pass = 5;
+
+  // Skips quiescent parts of the grid. step tracks which 16x16 tiles hold
+  // density or velocity above activity_threshold, or any source, and every
+  // stage only visits those tiles and the ring of tiles around them; tiles
+  // that decay below the threshold are cleared to zero. The pressure solve
+  // is limited to the same tiles, which changes the result: pressure far
+  // from the flow is taken to be zero rather than relaxed, and values below
+  // the threshold are dropped. Sparse steps always relax red-black, solve
+  // for pressure with sweeps even when pressure_method is Multigrid (which
+  // would leave pressure in the velocity outside the active tiles), and do
+  // not fuse passes; with obstacles the grid is always processed in full.
+  bool sparse = false;
+  float activity_threshold = 1e-4f;
+  int active_tiles() const { return tiles.active_count(); }
+  int total_tiles() const { return tiles.tile_count(); }
+
+  // The tile activity carried from one sparse step to the next (see
+  // ActiveTiles::state), for checkpoints.
+  const std::vector<unsigned char>& tile_state() const { return tiles.state(); }
+  void restore_tile_state(const std::vector<unsigned char>& state) { tiles.restore(state); }
+
+  // While a trace is recording (see trace.h), every stage is timed, and
+  // every invariants_every steps step also records the total density, the
+  // RMS velocity divergence left after the last projection and the relative
+  // residual of the last pressure solve. Those take a few passes over the
+  // grid, so 0 records them never.
+  int invariants_every = 10;
+
+  // Method the last pressure solve actually used, which is Sweeps whenever
+  // obstacles or a sparse step rule out multigrid, and its iteration count.
+  PressureMethod pressure_solve_method() const { return last_pressure_method; }
+  int pressure_iterations() const { return last_pressure_iterations; }
+
+  // Relative residual of the last multigrid pressure solve.
+  float pressure_residual() const { return multigrid ? multigrid->residual() : 0.0f; }
+
+  // Individual stages, public so they can be timed on their own. Each one
+  // corresponds to a compute shader; project is project_compute_a/b/c.
+  void add_source(float* dest, const float* src, float dt);
+  void diffuse(float* dest, const float* src, float diff, float dt, Boundary boundary = Reflect);
+  void project(float* vel_u, float* vel_v, float* p, float* div);
+  void divergence(const float* vel_u, const float* vel_v, float* p, float* div);
+  void pressure_solve(float* p, const float* div);
+  void subtract_gradient(float* vel_u, float* vel_v, const float* p);
+  void advect(float* dest, const float* src, const float* vel_u, const float* vel_v, float dt);
 
 private:
-  
-};
+  void fused_diffuse(float* dest, float* src, float diff, float dt);
+  void fused_project(float* vel_u, float* vel_v, float* p, float* div);
+  void relax_blocked(float* x, bool from_zero, const float* b, const BlockRowSource& first_b, float a, float c);
+  void each_span(const std::function<void(const RowSpan&)>& fn);
+  void record_invariants();
+  void clear_halo(float* field);
+  bool use_fused() const {
+    return fused && (int64_t)w * h >= fused_min_cells && relaxation == RedBlack && iterations > 0 && cell_flags.empty() && !region;
+  }
+  // Interior cells a stage visits, for throughput in traces.
+  int64_t traced_cells() const { return region ? region_cells : (int64_t)w * h; }
 
+  int w, h;
+  // Grid scale used by the physics, 1 / cell size.
+  int n;
+  const KernelTable& kernels;
+  RedBlackRow redblack;
+  std::vector<float> u, v, up, vp;
+  std::vector<float> dens, dens_prev;
+  std::vector<float> scratch;
+  // Right hand side of a fused diffuse, kept for the passes after the first.
+  std::vector<float> rhs;
+  // ObstacleMap flags, empty when there are no obstacles.
+  std::vector<unsigned char> cell_flags;
+  ThreadPool pool;
+  ActiveTiles tiles;
+  // Rows the stages are limited to during a sparse step, null otherwise.
+  const std::vector<RowSpan>* region = nullptr;
+  int64_t region_cells = 0;
+  int64_t steps_taken = 0;
+  std::unique_ptr<MultigridPoisson> multigrid;
+  PressureMethod last_pressure_method = Sweeps;
+  int last_pressure_iterations = 0;
+  // While set, the source fields are zero outside source_cells and the
+  // spans the last sparse step covered, dirty_spans.
+  bool sources_tracked = true;
+  std::vector<int> source_cells;
+  std::vector<RowSpan> dirty_spans;
+};
@@ -0,0 +1,61 @@
+#include "sources.h"
+#include "ensemble.h"
+#include "solver.h"
+
+#include <algorithm>
+
+SourceBatch::SourceBatch(int w, int h) :
+  w(w),
+  h(h) {
+
+}
+
+void SourceBatch::add(Field field, int x, int y, float value) {
+  if (x < 1 || x > w || y < 1 || y > h) return;
+  splats.push_back(Splat { field, x + (w + 2) * y, value });
+}
+
+void SourceBatch::add_square(Field field, int x, int y, int radius, float value) {
+  for (int j = y - radius; j < y + radius; j++) {
+    for (int i = x - radius; i < x + radius; i++) {
+      add(field, i, j, value);
+    }
+  }
+}
+
+void SourceBatch::apply(Solver& solver) const {
+  solver.add_sources(*this);
+}
+
+void SourceBatch::apply(Ensemble& ensemble, int member) const {
+  float* fields[] = { ensemble.density_source(member), ensemble.velocity_u_source(member), ensemble.velocity_v_source(member) };
+  for (const Splat& splat : splats) {
+    fields[splat.field][splat.cell] += splat.value;
+  }
+}
+
+void SourceBatch::runs(std::vector<Run>& out, std::vector<float>& values) const {
+  out.clear();
+  values.clear();
+
+  std::vector<Splat> sorted = splats;
+  std::stable_sort(sorted.begin(), sorted.end(), [](const Splat& a, const Splat& b) {
+    return a.field != b.field ? a.field < b.field : a.cell < b.cell;
+  });
+
+  for (size_t s = 0; s < sorted.size(); s++) {
+    const Splat& splat = sorted[s];
+    bool new_run = out.empty() || out.back().field != splat.field || out.back().first + out.back().count <= splat.cell - 1;
+    bool same_cell = !out.empty() && !new_run && out.back().first + out.back().count - 1 == splat.cell;
+
+    if (same_cell) {
+      values.back() += splat.value;
+    } else if (new_run) {
+      out.push_back(Run { splat.field, splat.cell, 1, (int)values.size() });
+      values.push_back(splat.value);
+    } else {
+      out.back().count++;
+      values.push_back(splat.value);
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+
+class Ensemble;
+class Solver;
+
+// Sources for one step as a short list of splats, so injecting input costs
+// in proportion to the input rather than to the grid: the solver adds them
+// to its zeroed source fields in place, and main.cpp uploads just the cells
+// they touch after clearing the GPU source buffers on the device.
+class SourceBatch {
+public:
+  enum Field { Density, VelocityU, VelocityV };
+
+  struct Splat {
+    Field field;
+    // Index into the (w+2) x (h+2) field.
+    int cell;
+    float value;
+  };
+
+  // Consecutive cells of one field, values[offset .. offset + count).
+  struct Run {
+    Field field;
+    int first;
+    int count;
+    int offset;
+  };
+
+  SourceBatch(int w, int h);
+
+  void clear() { splats.clear(); }
+  bool empty() const { return splats.empty(); }
+
+  // Adds value to one interior cell; cells outside the grid are dropped.
+  void add(Field field, int x, int y, float value);
+
+  // Adds value to every cell of [x - radius, x + radius) squared, the brush
+  // of add_liquid_point in main.cpp.
+  void add_square(Field field, int x, int y, int radius, float value);
+
+  const std::vector<Splat>& entries() const { return splats; }
+
+  // Adds every splat to the solver's source fields (see Solver::add_sources).
+  void apply(Solver& solver) const;
+  void apply(Ensemble& ensemble, int member) const;
+
+  // Sums splats that hit the same cell and groups the cells into runs of
+  // consecutive indices, so each run can be uploaded in one call.
+  void runs(std::vector<Run>& out, std::vector<float>& values) const;
+
+private:
+  int w, h;
+  std::vector<Splat> splats;
+};
@@ -0,0 +1,93 @@
+#include "thread_pool.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define FLUID_MXCSR 1
+#endif
+
+// Dye and velocity decay towards zero and end up as denormals, which are tens
+// of times slower to operate on, so bands run with flush-to-zero and
+// denormals-are-zero set. The caller's own mode is restored afterwards.
+class FlushDenormals {
+public:
+#if FLUID_MXCSR
+  FlushDenormals() : saved(_mm_getcsr()) { _mm_setcsr(saved | 0x8040); }
+  ~FlushDenormals() { _mm_setcsr(saved); }
+
+private:
+  unsigned int saved;
+#endif
+};
+
+ThreadPool::ThreadPool(int threads) {
+  if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+  if (threads <= 0) threads = 1;
+
+  for (int i = 1; i < threads; i++) {
+    workers.emplace_back(&ThreadPool::worker_loop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start_signal.notify_all();
+  for (auto& worker : workers) worker.join();
+}
+
+void ThreadPool::run_band(int band) {
+  int bands = size();
+  int rows = job_end - job_begin;
+  int row_begin = job_begin + (rows * band) / bands;
+  int row_end = job_begin + (rows * (band + 1)) / bands;
+  if (row_begin < row_end) (*job)(row_begin, row_end);
+}
+
+void ThreadPool::parallel_rows(int begin, int end, const band_function& fn) {
+  FlushDenormals flush;
+
+  if (workers.empty() || end - begin < 2) {
+    if (begin < end) fn(begin, end);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &fn;
+    job_begin = begin;
+    job_end = end;
+    pending = (int)workers.size();
+    generation++;
+  }
+  start_signal.notify_all();
+
+  run_band(0);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done_signal.wait(lock, [this] { return pending == 0; });
+  job = nullptr;
+}
+
+void ThreadPool::worker_loop(int band) {
+  FlushDenormals flush;
+  unsigned int seen = 0;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start_signal.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping) return;
+      seen = generation;
+    }
+
+    run_band(band);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending--;
+    }
+    done_signal.notify_one();
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that split a range of grid rows into
+// contiguous bands. The calling thread always runs the first band itself,
+// so a pool of size 1 has no workers and costs nothing.
+class ThreadPool {
+public:
+  typedef std::function<void(int, int)> band_function;
+
+  explicit ThreadPool(int threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Calls fn(row_begin, row_end) once per band covering [begin, end) and
+  // returns when every band has finished.
+  void parallel_rows(int begin, int end, const band_function& fn);
+
+  int size() const { return (int)workers.size() + 1; }
+
+private:
+  void worker_loop(int band);
+  void run_band(int band);
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable start_signal;
+  std::condition_variable done_signal;
+
+  const band_function* job = nullptr;
+  int job_begin = 0;
+  int job_end = 0;
+  unsigned int generation = 0;
+  int pending = 0;
+  bool stopping = false;
+};
@@ -0,0 +1,181 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <set>
+
+std::atomic<bool> trace_recording { false };
+
+static std::unique_ptr<TraceRing> ring;
+static std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+static std::atomic<int> next_thread { 0 };
+
+TraceRing::TraceRing(int capacity) {
+  uint64_t size = 1;
+  while (size < (uint64_t)std::max(capacity, 1)) size *= 2;
+  slots.reset(new Slot[size]);
+  mask = size - 1;
+}
+
+void TraceRing::push(const TraceEvent& event) {
+  uint64_t ticket = head.fetch_add(1, std::memory_order_relaxed);
+  Slot& slot = slots[ticket & mask];
+
+  slot.sequence.store(2 * ticket + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.event = event;
+  slot.sequence.store(2 * ticket + 2, std::memory_order_release);
+}
+
+void TraceRing::collect(std::vector<TraceEvent>& out) const {
+  uint64_t end = head.load(std::memory_order_acquire);
+  uint64_t begin = end > mask + 1 ? end - (mask + 1) : 0;
+
+  for (uint64_t ticket = begin; ticket < end; ticket++) {
+    const Slot& slot = slots[ticket & mask];
+    uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence != 2 * ticket + 2) continue;
+
+    TraceEvent event = slot.event;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue;
+
+    out.push_back(event);
+  }
+}
+
+void trace_start(int capacity) {
+  trace_recording.store(false);
+  ring.reset(new TraceRing(capacity));
+  epoch = std::chrono::steady_clock::now();
+  trace_recording.store(true);
+}
+
+void trace_stop() {
+  trace_recording.store(false);
+}
+
+int64_t trace_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+int trace_thread() {
+  thread_local int id = next_thread.fetch_add(1);
+  return id;
+}
+
+void trace_span(const char* name, int track, int64_t begin_ns, int64_t end_ns, int64_t cells) {
+  if (!trace_active()) return;
+  ring->push(TraceEvent { TraceEvent::Span, name, track, begin_ns, end_ns - begin_ns, cells, 0.0 });
+}
+
+void trace_counter(const char* name, double value) {
+  if (!trace_active()) return;
+  ring->push(TraceEvent { TraceEvent::Counter, name, trace_thread(), trace_now_ns(), 0, 0, value });
+}
+
+void trace_events(std::vector<TraceEvent>& out) {
+  out.clear();
+  if (ring) ring->collect(out);
+}
+
+uint64_t trace_overwritten() {
+  if (!ring || ring->pushed() <= (uint64_t)ring->capacity()) return 0;
+  return ring->pushed() - ring->capacity();
+}
+
+bool trace_write_chrome(const char* path, std::string& error) {
+  std::vector<TraceEvent> events;
+  trace_events(events);
+
+  std::ofstream file(path);
+  if (!file) {
+    error = std::string("could not create ") + path;
+    return false;
+  }
+
+  // Timestamps are in microseconds.
+  file << std::fixed << std::setprecision(3);
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+  std::set<int> tracks;
+  for (const TraceEvent& event : events) tracks.insert(event.track);
+  bool first = true;
+  for (int track : tracks) {
+    file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track << ",\"args\":{\"name\":\"";
+    if (track == trace_gpu_track) file << "GPU";
+    else file << "thread " << track;
+    file << "\"}}";
+    first = false;
+  }
+
+  for (const TraceEvent& event : events) {
+    file << (first ? "" : ",\n");
+    first = false;
+    if (event.kind == TraceEvent::Span) {
+      file << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.track;
+      file << ",\"ts\":" << event.begin_ns / 1000.0 << ",\"dur\":" << event.duration_ns / 1000.0;
+      if (event.cells > 0) {
+        file << ",\"args\":{\"cells\":" << event.cells << ",\"ns_per_cell\":" << (double)event.duration_ns / event.cells << "}";
+      }
+      file << "}";
+    } else {
+      file << "{\"name\":\"" << event.name << "\",\"ph\":\"C\",\"pid\":1,\"tid\":" << event.track;
+      file << ",\"ts\":" << event.begin_ns / 1000.0 << ",\"args\":{\"value\":" << std::setprecision(9) << event.value << std::setprecision(3) << "}}";
+    }
+  }
+
+  file << "\n]}\n";
+  if (!file) {
+    error = std::string("could not write ") + path;
+    return false;
+  }
+  return true;
+}
+
+void trace_write_summary(std::ostream& out) {
+  struct Stage {
+    int calls = 0;
+    int64_t ns = 0;
+    int64_t cells = 0;
+  };
+
+  std::vector<TraceEvent> events;
+  trace_events(events);
+
+  // Keyed by track too, so GPU and CPU stages of the same name stay apart.
+  std::map<std::pair<std::string, bool>, Stage> stages;
+  std::map<std::string, double> counters;
+  for (const TraceEvent& event : events) {
+    if (event.kind == TraceEvent::Counter) {
+      counters[event.name] = event.value;
+      continue;
+    }
+    Stage& stage = stages[{ event.name, event.track == trace_gpu_track }];
+    stage.calls++;
+    stage.ns += event.duration_ns;
+    stage.cells += event.cells;
+  }
+
+  std::ios_base::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+  out << std::fixed << std::setprecision(3);
+  for (const auto& entry : stages) {
+    const Stage& stage = entry.second;
+    out << (entry.first.second ? "gpu " : "") << entry.first.first << ": " << stage.calls << " calls, ";
+    out << stage.ns / 1e6 / stage.calls << " ms each";
+    if (stage.cells > 0) out << ", " << (double)stage.ns / stage.cells << " ns/cell";
+    out << std::endl;
+  }
+  out.flags(flags);
+  out.precision(precision);
+
+  for (const auto& entry : counters) {
+    out << entry.first << ": " << entry.second << std::endl;
+  }
+}
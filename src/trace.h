@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Timeline instrumentation for the solver and the GPU path.
+//
+// Stages are wrapped in FLUID_TRACE_SCOPE and values such as the pressure
+// residual are recorded with FLUID_TRACE_COUNTER. Nothing is recorded until
+// trace_start is called; until then a scope costs one relaxed atomic load.
+// While recording, a scope reads the clock twice and writes one event into
+// a fixed size ring buffer without taking a lock, which is cheap next to
+// any stage, so traces can stay on for production runs. The ring keeps the
+// most recent events and overwrites the oldest. Building with FLUID_TRACE
+// defined to 0 turns both macros into nothing.
+#ifndef FLUID_TRACE
+#define FLUID_TRACE 1
+#endif
+
+struct TraceEvent {
+  enum Kind { Span, Counter };
+
+  Kind kind;
+  // Must outlive the trace; the macros take string literals.
+  const char* name;
+  // trace_thread() of the recording thread, or trace_gpu_track.
+  int track;
+  // Nanoseconds since trace_start.
+  int64_t begin_ns;
+  int64_t duration_ns;
+  // Interior cells a span processed, for throughput. Zero if not known.
+  int64_t cells;
+  // A counter's value.
+  double value;
+};
+
+// Multi-producer ring of events. push claims a slot with one atomic
+// increment and publishes it through the slot's sequence number, so
+// threads never wait on each other. collect copies the slots whose writes
+// have completed and skips any being overwritten while it reads them.
+class TraceRing {
+public:
+  // Capacity is rounded up to a power of two.
+  explicit TraceRing(int capacity);
+
+  void push(const TraceEvent& event);
+
+  // The events still in the ring, oldest first.
+  void collect(std::vector<TraceEvent>& out) const;
+
+  int capacity() const { return (int)(mask + 1); }
+  uint64_t pushed() const { return head.load(std::memory_order_relaxed); }
+
+private:
+  struct Slot {
+    // 2 * ticket + 2 once the event of that ticket is complete, odd while
+    // it is being written.
+    std::atomic<uint64_t> sequence { 0 };
+    TraceEvent event;
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  uint64_t mask;
+  std::atomic<uint64_t> head { 0 };
+};
+
+// Track of spans measured on the GPU.
+const int trace_gpu_track = 1000;
+
+extern std::atomic<bool> trace_recording;
+
+inline bool trace_active() { return trace_recording.load(std::memory_order_relaxed); }
+
+// Starts recording into a fresh ring of the given capacity, or stops it.
+// Call them between steps, from the thread that drives the solver.
+void trace_start(int capacity = 1 << 16);
+void trace_stop();
+
+int64_t trace_now_ns();
+
+// Small id of the calling thread, in order of first use.
+int trace_thread();
+
+void trace_span(const char* name, int track, int64_t begin_ns, int64_t end_ns, int64_t cells);
+void trace_counter(const char* name, double value);
+
+// Events of the last recording, oldest first, and how many were lost to
+// the ring wrapping.
+void trace_events(std::vector<TraceEvent>& out);
+uint64_t trace_overwritten();
+
+// Writes the events as Chrome trace JSON, for chrome://tracing or Perfetto.
+bool trace_write_chrome(const char* path, std::string& error);
+
+// Per stage calls, mean time and ns per cell, and the last value of every
+// counter.
+void trace_write_summary(std::ostream& out);
+
+// Records a span from construction to destruction if a trace is recording.
+class TraceScope {
+public:
+  TraceScope(const char* name, int64_t cells) : name(name), cells(cells), begin(trace_active() ? trace_now_ns() : -1) {}
+
+  ~TraceScope() {
+    if (begin >= 0) trace_span(name, trace_thread(), begin, trace_now_ns(), cells);
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+  const char* name;
+  int64_t cells;
+  int64_t begin;
+};
+
+#if FLUID_TRACE
+#define FLUID_TRACE_JOIN2(a, b) a##b
+#define FLUID_TRACE_JOIN(a, b) FLUID_TRACE_JOIN2(a, b)
+#define FLUID_TRACE_SCOPE(name, cells) TraceScope FLUID_TRACE_JOIN(trace_scope_, __LINE__)(name, cells)
+#define FLUID_TRACE_COUNTER(name, value) do { if (trace_active()) trace_counter(name, value); } while (0)
+#else
+#define FLUID_TRACE_SCOPE(name, cells) ((void)0)
+#define FLUID_TRACE_COUNTER(name, value) ((void)0)
+#endif